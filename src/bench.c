@@ -0,0 +1,904 @@
+//bench.c
+
+//offline benchmark for the osc2midi converter
+//this runs the conversion code without a network or a jack server, midi
+//messages are just counted (or written to a file) by the stand-in sequencer
+//below, which also hands out the midi input for the midi->osc runs. Osc
+//messages going out are serialised but never leave the process.
+
+#include<stdlib.h>
+#include<stdio.h>
+#include<stdint.h>
+#include<string.h>
+#include<ctype.h>
+#include<time.h>
+#include<unistd.h>
+#include<pthread.h>
+#include<sys/socket.h>
+#include<netinet/in.h>
+#include"pair.h"
+#include"oscserver.h"
+#include"converter.h"
+#include"midiseq.h"
+
+#ifndef MAPDIR
+#define MAPDIR "."
+#endif
+
+int msg_handler(const char *path, const char *types, lo_arg ** argv,
+                int argc, void *data, void *user_data);
+
+//per thread, for the -threads runs
+static __thread unsigned long nqueued = 0;
+static FILE* midi_out = NULL;
+
+//what msg_handler gets from liblo for a message outside of a bundle
+static lo_message plain = NULL;
+
+//midi input for the midi->osc runs, pop_midi hands out the events from
+//feed_pos up to feed_end
+static uint8_t (*feed)[3] = NULL;
+static int feed_pos = 0, feed_end = 0;
+
+#ifdef __GLIBC__
+//count allocations, glibc lets a program replace malloc and friends
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+static unsigned long nallocs = 0;
+
+void* malloc(size_t size)
+{
+    __atomic_fetch_add(&nallocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size)
+{
+    __atomic_fetch_add(&nallocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n,size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+    __atomic_fetch_add(&nallocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr,size);
+}
+#define ALLOCS (double)__atomic_load_n(&nallocs, __ATOMIC_RELAXED)
+#else
+#define ALLOCS (0.0/0.0)
+#endif
+
+//stand-in midi sequencer, nothing leaves the process
+int init_midi_seq(MIDI_SEQ* seq, uint8_t verbose, const char* clientname)
+{
+    return 1;
+}
+
+void close_midi_seq(MIDI_SEQ* seq)
+{
+}
+
+const MIDI_DRIVER* find_midi_driver(const char* name)
+{
+    return NULL;
+}
+
+void queue_midi_at(MIDI_SEQ* seq, uint8_t msg[], double delay)
+{
+    nqueued++;
+    if(midi_out)
+        fprintf(midi_out,"%02x %02x %02x\n",msg[0],msg[1],msg[2]);
+}
+
+int get_midi_ring_stats(MIDI_SEQ* seq, int ring, MIDI_RING_STATS* st)
+{
+    return 0;
+}
+
+int pop_midi(MIDI_SEQ* seq, uint8_t msg[])
+{
+    if(feed_pos >= feed_end)
+        return 0;
+    memcpy(msg,feed[feed_pos++],3);
+    return 3;
+}
+
+//stand-in osc output
+static unsigned long nbytes = 0;
+static char sink[65536];
+
+static int sink_message(lo_address targ, const char* path, lo_message msg)
+{
+    size_t size = lo_message_length(msg,path);
+    if(size <= sizeof(sink))
+        lo_message_serialise(msg,path,sink,&size);
+    nbytes += size;
+    return 0;
+}
+
+static int sink_bundle(lo_address targ, lo_bundle b)
+{
+    size_t size = lo_bundle_length(b);
+    if(size <= sizeof(sink))
+        lo_bundle_serialise(b,sink,&size);
+    nbytes += size;
+    return 0;
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+void usage()
+{
+    printf("osc2midi-bench - offline benchmark for the osc2midi converter\n");
+    printf("\n");
+    printf("USAGE:\n");
+    printf("    osc2midi-bench [-option <value>...]\n");
+    printf("\n");
+    printf("OPTIONS:\n");
+    printf("    -rules <n,n,...>  rule counts of the generated maps (default 10,100,500,1000,2000,5000)\n");
+    printf("    -msgs <value>     messages sent through the converter per run (default 200000)\n");
+    printf("    -m <value>        run a corpus of messages through this map file instead\n");
+    printf("    -corpus <value>   read the corpus for -m from a file (default: made from the map)\n");
+    printf("    -dump <value>     write the corpus made from the map to a file\n");
+    printf("    -o <value>        write the midi messages that come out to a file\n");
+    printf("    -single           stop at the first match (default is multi mode)\n");
+    printf("    -midi <value>     run a midi stream through the -m map to osc instead, the stream is\n");
+    printf("                      notes (note on/off storm), bend (14 bit pitchbend sweeps), cc (cc\n");
+    printf("                      flood on all channels) or mixed\n");
+    printf("    -drain <value>    midi events handled per call of convert_midi_in (default 16)\n");
+    printf("    -bundle           send the osc messages of each drain as bundles\n");
+    printf("    -threads <value>  run the corpus of the -m map on 1 up to this many threads at once\n");
+    printf("    -micro            time try_match_osc and try_match_midi on the /multi/{i} and /mlr/press rules\n");
+    printf("                      of the -m map (default maps/default.omm)\n");
+    printf("    -reply <value>    check that /osc2midi/stats sent to osc workers on this udp port\n");
+    printf("                      gets an answer\n");
+    printf("    -h                show this message\n");
+    printf("\n");
+    printf("    A corpus has one osc message per line, path, types and then the args,\n");
+    printf("    as oscdump prints them, e.g.  /1/fader1 f 0.5\n");
+    printf("\n");
+}
+
+//the workers read their sockets themselves, so they have to tell the
+//handlers who sent what they dispatch or there's nowhere to answer to
+static int check_reply(CONVERTER* conv, char* file, char* port)
+{
+    int sock, ok;
+    char buf[1500];
+    struct sockaddr_in to;
+    struct timeval tv = {1, 0};
+    static const char req[] = "/osc2midi/stats\0,\0\0\0";
+
+    if(load_map(conv,file) <= 0)
+        return -1;
+    conv->workers = 2;
+    if(!start_osc_workers(port,conv))
+        return -1;
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    to.sin_port = htons(atoi(port));
+    to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sendto(sock, req, sizeof(req)-1, 0, (struct sockaddr*)&to, sizeof(to));
+    ok = recv(sock, buf, sizeof(buf), 0) > 0 && !strncmp(buf, "/osc2midi/stats/", 16);
+    printf("/osc2midi/stats over an osc worker: %s\n", ok ? "answered" : "NO ANSWER");
+    close(sock);
+    stop_osc_workers(0);
+    free_map(conv);
+    return ok ? 0 : -1;
+}
+
+//write a touchosc style map with n rules, and remember one path per rule to
+//send to it. Most controls are faders and push buttons on pages of 100
+//controls, every page also has a multitoggle with the row in the path
+static int gen_map(const char* file, int n, char (*paths)[64])
+{
+    int i;
+    FILE* map = fopen(file,"w");
+
+    if(!map)
+        return -1;
+    for(i=0; i<n; i++)
+    {
+        int page = i/100+1, ctl = i%100;
+        if(ctl == 0)
+        {
+            fprintf(map,"/%i/multitoggle/{i}/1 f, row, v : controlchange( %i, row, 127*v )\n",page,page%16);
+            sprintf(paths[i],"/%i/multitoggle/%i/1",page,i%8+1);
+        }
+        else if(ctl%5 == 0)
+        {
+            fprintf(map,"/%i/push%i f, v : noteon( %i, %i, 127*v )\n",page,ctl,page%16,ctl);
+            sprintf(paths[i],"/%i/push%i",page,ctl);
+        }
+        else
+        {
+            fprintf(map,"/%i/fader%i f, v : controlchange( %i, %i, 127*v )\n",page,ctl,page%16,ctl);
+            sprintf(paths[i],"/%i/fader%i",page,ctl);
+        }
+    }
+    fclose(map);
+    return 0;
+}
+
+//one run over nmsgs messages, either through msg_handler (indexed) or by
+//trying every pair like the converter used to do
+static double run(CONVERTER* conv, char (*paths)[64], int n, int nmsgs, int scan)
+{
+    int i,j;
+    uint8_t midi[3];
+    lo_arg arg;
+    lo_arg* argv[1] = {&arg};
+    double t0 = now();
+
+    for(i=0; i<nmsgs; i++)
+    {
+        char* path = paths[(i*7919)%n];
+        arg.f = (i%128)/127.0;
+        if(!scan)
+        {
+            msg_handler(path,"f",argv,1,plain,conv);
+            continue;
+        }
+        for(j=0; j<conv->map->npairs; j++)
+        {
+            if(try_match_osc(conv->map->p[j],path,"f",argv,1,conv->strict_match,&conv->glob_chan,&conv->glob_vel,&conv->filter,midi) > 0)
+            {
+                queue_midi_at(&conv->seq,midi,0);
+                if(!conv->multi_match)
+                    break;
+            }
+        }
+    }
+    return nmsgs/(now()-t0);
+}
+
+//messages for the path matching micro benchmark, these go to the rules for
+//multitouch, multibutton and the monome (mlr) emulation in default.omm
+typedef struct _MICRO_MSG
+{
+    const char* path;
+    const char* types;
+    float argv[3];
+} MICRO_MSG;
+
+static const MICRO_MSG micro_msgs[] =
+{
+    {"/multi/3", "ff", {.5, .25, 0}},
+    {"/multi/12", "i", {1, 0, 0}},
+    {"/multi/", "ff", {.5, .25, 0}},//no variable, doesn't match
+    {"/mlr/press", "iii", {3, 5, 1}},
+    {"/mlr/presses", "iii", {3, 5, 1}},//doesn't match either
+};
+
+//time try_match_osc for every rule in the map that has the path of one of
+//the micro benchmark messages, and try_match_midi with the midi message it
+//made if it matched
+static int micro(char* file, int nmsgs)
+{
+    int i,j,k,n;
+    char prefix[200], path[200];
+    uint8_t midi[3];
+    lo_message oscm;
+    double t0;
+    lo_arg args[3];
+    lo_arg* argv[3] = {&args[0],&args[1],&args[2]};
+    CONVERTER conv;
+
+    memset(&conv,0,sizeof(conv));
+    conv.glob_vel = 100;
+    if(load_map(&conv,file) <= 0)
+        return -1;
+    printf("%5s  %-24s %-16s %10s %8s %10s\n","pair","rule","message","osc ns","match","midi ns");
+    for(j=0; j<conv.map->npairs; j++)
+    {
+        PAIRHANDLE ph = conv.map->p[j];
+        get_pair_osc_prefix(ph,prefix);
+        if(strcmp(prefix,"/multi/") && strcmp(prefix,"/mlr/press"))
+            continue;
+        for(i=0; i<sizeof(micro_msgs)/sizeof(MICRO_MSG); i++)
+        {
+            const MICRO_MSG* m = &micro_msgs[i];
+            double tosc;
+            if(strcmp(m->types,get_pair_types(ph)))
+                continue;
+            for(k=0; m->types[k]; k++)
+            {
+                if(m->types[k] == 'i')
+                    args[k].i = m->argv[k];
+                else
+                    args[k].f = m->argv[k];
+            }
+            t0 = now();
+            for(k=n=0; k<nmsgs; k++)
+                n += try_match_osc(ph,(char*)m->path,(char*)m->types,argv,strlen(m->types),0,&conv.glob_chan,&conv.glob_vel,&conv.filter,midi) > 0;
+            tosc = (now()-t0)*1e9/nmsgs;
+            if(!n)
+            {
+                printf("%5i  %-24s %-16s %10.1f %8s %10s\n",j+1,prefix,m->path,tosc,"no","-");
+                continue;
+            }
+            t0 = now();
+            for(k=0; k<nmsgs; k++)
+                try_match_midi(ph,midi,0,&conv.glob_chan,path,&oscm);
+            printf("%5i  %-24s %-16s %10.1f %8s %10.1f\n",j+1,prefix,m->path,tosc,"yes",(now()-t0)*1e9/nmsgs);
+        }
+    }
+    free_map(&conv);
+    return 0;
+}
+
+//a message of the corpus
+#define MAX_ARGS 16
+typedef struct _CORPUS_MSG
+{
+    char path[200];
+    char types[MAX_ARGS+1];
+    lo_arg args[MAX_ARGS];
+    char strs[MAX_ARGS][32];//string args
+    lo_arg* argv[MAX_ARGS];
+} CORPUS_MSG;
+
+static void set_argv(CORPUS_MSG* m)
+{
+    int k;
+    for(k=0; m->types[k]; k++)
+    {
+        if(m->types[k] == 's' || m->types[k] == 'S')
+            m->argv[k] = (lo_arg*)m->strs[k];
+        else
+            m->argv[k] = &m->args[k];
+    }
+}
+
+//make a few messages for every rule in the map, the first two send all 0s
+//and all 1s like buttons and toggles do, the rest random values
+static CORPUS_MSG* gen_corpus(CONVERTER* conv, int* n)
+{
+    int i,j,k,v[100];
+    const int variants = 4;
+    CORPUS_MSG* corpus = calloc(conv->map->npairs*variants+1, sizeof(CORPUS_MSG));
+
+    srand(1);
+    *n = 0;
+    for(j=0; j<conv->map->npairs; j++)
+    {
+        char* types = get_pair_types(conv->map->p[j]);
+        if(strlen(types) > MAX_ARGS)
+            continue;
+        for(i=0; i<variants; i++)
+        {
+            CORPUS_MSG* m = &corpus[(*n)++];
+            //touchosc style controls count from 1
+            for(k=0; k<100; k++)
+                v[k] = 1 + rand()%8;
+            get_pair_osc_path(conv->map->p[j],v,m->path);
+            strcpy(m->types,types);
+            for(k=0; types[k]; k++)
+            {
+                switch(types[k])
+                {
+                case 'i':
+                case 'c':
+                    m->args[k].i = i<2 ? i : rand()%128;
+                    break;
+                case 'h':
+                    m->args[k].h = i<2 ? i : rand()%128;
+                    break;
+                case 'f':
+                    m->args[k].f = i<2 ? i : (rand()%1001)/1000.0;
+                    break;
+                case 'd':
+                    m->args[k].d = i<2 ? i : (rand()%1001)/1000.0;
+                    break;
+                case 'm':
+                    m->args[k].m[1] = 0x90 + rand()%16;
+                    m->args[k].m[2] = rand()%128;
+                    m->args[k].m[3] = rand()%128;
+                    break;
+                default:
+                    break;
+                }
+            }
+            set_argv(m);
+        }
+    }
+    return corpus;
+}
+
+//next token of a corpus line, brackets and quotes are skipped
+static char* next_token(char** s)
+{
+    char* tok;
+    while(**s && (isspace(**s) || strchr("[]\"",**s)))
+        (*s)++;
+    if(!**s)
+        return NULL;
+    tok = *s;
+    while(**s && !isspace(**s) && !strchr("[]\"",**s))
+        (*s)++;
+    if(**s)
+        *(*s)++ = 0;
+    return tok;
+}
+
+static CORPUS_MSG* load_corpus(const char* file, int* n)
+{
+    int k,size = 1024;
+    char line[1024], *s, *tok;
+    CORPUS_MSG* corpus;
+    FILE* f = fopen(file,"r");
+
+    if(!f)
+        return NULL;
+    corpus = malloc(size*sizeof(CORPUS_MSG));
+    *n = 0;
+    while(fgets(line,sizeof(line),f))
+    {
+        CORPUS_MSG* m = &corpus[*n];
+        s = line;
+        if(!(tok = next_token(&s)) || *tok != '/')
+            continue;//empty, comment or not a message
+        memset(m,0,sizeof(CORPUS_MSG));
+        strncpy(m->path,tok,199);
+        if((tok = next_token(&s)))
+            strncpy(m->types,tok + (*tok == ','),MAX_ARGS);
+        for(k=0; m->types[k]; k++)
+        {
+            if(strchr("TFNI",m->types[k]))
+                continue;//no value
+            if(!(tok = next_token(&s)))
+                break;
+            switch(m->types[k])
+            {
+            case 'i':
+            case 'c':
+                m->args[k].i = strtol(tok,NULL,0);
+                break;
+            case 'h':
+                m->args[k].h = strtoll(tok,NULL,0);
+                break;
+            case 'f':
+                m->args[k].f = strtod(tok,NULL);
+                break;
+            case 'd':
+                m->args[k].d = strtod(tok,NULL);
+                break;
+            case 's':
+            case 'S':
+                strncpy(m->strs[k],tok,31);
+                break;
+            case 'm':
+            {
+                int b;
+                if(!strcmp(tok,"MIDI"))
+                    tok = next_token(&s);
+                for(b=0; b<4 && tok; b++)
+                {
+                    m->args[k].m[b] = strtol(tok,NULL,0);
+                    if(b<3)
+                        tok = next_token(&s);
+                }
+                break;
+            }
+            default:
+                break;
+            }
+        }
+        set_argv(m);
+        if(++*n == size)
+        {
+            size *= 2;
+            corpus = realloc(corpus,size*sizeof(CORPUS_MSG));
+        }
+    }
+    fclose(f);
+    return corpus;
+}
+
+static void dump_corpus(FILE* f, CORPUS_MSG* corpus, int n)
+{
+    int i,k;
+    for(i=0; i<n; i++)
+    {
+        CORPUS_MSG* m = &corpus[i];
+        fprintf(f,"%s %s",m->path,m->types);
+        for(k=0; m->types[k]; k++)
+        {
+            switch(m->types[k])
+            {
+            case 'i':
+            case 'c':
+                fprintf(f," %i",m->args[k].i);
+                break;
+            case 'h':
+                fprintf(f," %lli",(long long)m->args[k].h);
+                break;
+            case 'f':
+                fprintf(f," %f",m->args[k].f);
+                break;
+            case 'd':
+                fprintf(f," %f",m->args[k].d);
+                break;
+            case 's':
+            case 'S':
+                fprintf(f," \"%s\"",m->strs[k]);
+                break;
+            case 'm':
+                fprintf(f," MIDI [0x%02x 0x%02x 0x%02x 0x%02x]",m->args[k].m[0],m->args[k].m[1],m->args[k].m[2],m->args[k].m[3]);
+                break;
+            default:
+                break;
+            }
+        }
+        fprintf(f,"\n");
+    }
+}
+
+static int cmp_float(const void* a, const void* b)
+{
+    float x = *(const float*)a, y = *(const float*)b;
+    return (x > y) - (x < y);
+}
+
+//send the corpus through msg_handler over and over, once to get the
+//throughput and once timing every message on its own
+static int run_map(CONVERTER* conv, char* file, char* corpus_file, char* dump, int nmsgs)
+{
+    int i,n,matched = 0;
+    unsigned long before;
+    double t0,t,overhead;
+    float* lat;
+    FILE* out = midi_out;
+    CORPUS_MSG* corpus;
+
+    if(load_map(conv,file) <= 0)
+        return -1;
+    if(corpus_file)
+        corpus = load_corpus(corpus_file,&n);
+    else
+        corpus = gen_corpus(conv,&n);
+    if(!corpus || !n)
+    {
+        printf("No messages to send!\n");
+        return -1;
+    }
+    if(dump)
+    {
+        FILE* f = fopen(dump,"w");
+        if(f)
+        {
+            dump_corpus(f,corpus,n);
+            fclose(f);
+        }
+    }
+    printf("map %s, %i pairs, %i messages in the corpus (%s)\n",file,conv->map->npairs,n,corpus_file?corpus_file:"generated");
+
+    //throughput
+    nqueued = 0;
+    t0 = now();
+    for(i=0; i<nmsgs; i++)
+    {
+        CORPUS_MSG* m = &corpus[i%n];
+        msg_handler(m->path,m->types,m->argv,strlen(m->types),plain,conv);
+    }
+    t = now()-t0;
+    printf("  %-16s %i\n","messages",nmsgs);
+    printf("  %-16s %.0f\n","msg/s",nmsgs/t);
+    printf("  %-16s %.2f\n","midi/msg",(double)nqueued/nmsgs);
+
+    //latency of each message, without the output file
+    lat = malloc(sizeof(float)*nmsgs);
+    t0 = now();
+    for(i=0; i<1000; i++)
+        now();
+    overhead = (now()-t0)/1000;
+    midi_out = NULL;
+    for(i=0; i<nmsgs; i++)
+    {
+        CORPUS_MSG* m = &corpus[i%n];
+        before = nqueued;
+        t0 = now();
+        msg_handler(m->path,m->types,m->argv,strlen(m->types),plain,conv);
+        lat[i] = (now()-t0-overhead)*1e9;
+        matched += nqueued != before;
+    }
+    midi_out = out;
+    qsort(lat,nmsgs,sizeof(float),cmp_float);
+    printf("  %-16s %.1f%%\n","matched",100.0*matched/nmsgs);
+    printf("  %-16s p50 %.0f  p90 %.0f  p99 %.0f  p99.9 %.0f  max %.0f\n","latency ns",
+           lat[nmsgs/2],lat[nmsgs*9/10],lat[nmsgs*99/100],lat[(int)(nmsgs*0.999)],lat[nmsgs-1]);
+    free(lat);
+    free(corpus);
+    free_map(conv);
+    return 0;
+}
+
+typedef struct _BENCH_THREAD
+{
+    pthread_t thread;
+    CONVERTER* conv;
+    CORPUS_MSG* corpus;
+    int n;
+    int first;
+    int nmsgs;
+    unsigned long nqueued;
+} BENCH_THREAD;
+
+static void* bench_thread(void* arg)
+{
+    int i;
+    BENCH_THREAD* bt = (BENCH_THREAD*)arg;
+
+    for(i=0; i<bt->nmsgs; i++)
+    {
+        CORPUS_MSG* m = &bt->corpus[(bt->first+i)%bt->n];
+        msg_handler(m->path,m->types,m->argv,strlen(m->types),plain,bt->conv);
+    }
+    bt->nqueued = nqueued;
+    return NULL;
+}
+
+//what the osc workers do, minus the sockets: every thread sends nmsgs
+//messages of the corpus through msg_handler, all on the same map
+static int run_threads(CONVERTER* conv, char* file, char* corpus_file, int nmsgs, int nthreads)
+{
+    int i,k,n;
+    double t, base = 0;
+    unsigned long total;
+    FILE* out = midi_out;
+    CORPUS_MSG* corpus;
+    BENCH_THREAD* bt;
+
+    if(load_map(conv,file) <= 0)
+        return -1;
+    if(corpus_file)
+        corpus = load_corpus(corpus_file,&n);
+    else
+        corpus = gen_corpus(conv,&n);
+    if(!corpus || !n)
+    {
+        printf("No messages to send!\n");
+        return -1;
+    }
+    printf("map %s, %i pairs, %i messages in the corpus, %ld cores\n",file,conv->map->npairs,n,sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%8s %16s %10s %10s %10s\n","threads","msg/s","speedup","per core","midi/msg");
+
+    midi_out = NULL;
+    bt = calloc(nthreads,sizeof(BENCH_THREAD));
+    for(k=1; k<=nthreads; k++)
+    {
+        t = now();
+        for(i=0; i<k; i++)
+        {
+            bt[i].conv = conv;
+            bt[i].corpus = corpus;
+            bt[i].n = n;
+            bt[i].first = i*n/k;
+            bt[i].nmsgs = nmsgs;
+            pthread_create(&bt[i].thread,NULL,bench_thread,&bt[i]);
+        }
+        total = 0;
+        for(i=0; i<k; i++)
+        {
+            pthread_join(bt[i].thread,NULL);
+            total += bt[i].nqueued;
+        }
+        t = (double)k*nmsgs/(now()-t);
+        if(k == 1)
+            base = t;
+        printf("%8i %16.0f %10.2f %10.0f %10.2f\n",k,t,t/base,t/k,(double)total/k/nmsgs);
+    }
+    midi_out = out;
+    free(bt);
+    free(corpus);
+    free_map(conv);
+    return 0;
+}
+
+//synthetic midi streams for the midi->osc runs
+static int gen_stream(const char* name, uint8_t (*ev)[3], int n)
+{
+    int i, kind = -1;
+    const char* kinds[] = {"notes","bend","cc","mixed"};
+
+    for(i=0; i<4; i++)
+        if(!strcmp(name,kinds[i]))
+            kind = i;
+    if(kind < 0)
+        return -1;
+    for(i=0; i<n; i++)
+    {
+        int k = kind == 3 ? i%3 : kind;
+        int ch = i%16, j = i/16;
+        if(k == 0)
+        {
+            //every note is turned on and then off again
+            ev[i][0] = (j%2 ? 0x80 : 0x90) | ch;
+            ev[i][1] = 36 + (j/2)%61;
+            ev[i][2] = j%2 ? 64 : 100;
+        }
+        else if(k == 1)
+        {
+            int v = (j*37)%16384;
+            ev[i][0] = 0xE0 | ch;
+            ev[i][1] = v&0x7F;
+            ev[i][2] = v>>7;
+        }
+        else
+        {
+            ev[i][0] = 0xB0 | ch;
+            ev[i][1] = j%128;
+            ev[i][2] = (j/128+i)%128;
+        }
+    }
+    return n;
+}
+
+//feed a midi stream to convert_midi_in drain events at a time for the
+//throughput, then time every event on its own
+static int run_midi(CONVERTER* conv, char* file, char* stream, int nmsgs, int drain)
+{
+    int i;
+    double t0,t,allocs,overhead;
+    float* lat;
+
+    if(load_map(conv,file) <= 0)
+        return -1;
+    feed = malloc(sizeof(*feed)*nmsgs);
+    if(gen_stream(stream,feed,nmsgs) < 0)
+    {
+        printf("Unknown midi stream %s!\n",stream);
+        return -1;
+    }
+    conv->send_message = sink_message;
+    conv->send_bundle = sink_bundle;
+    printf("map %s, %i pairs, %s midi stream, %i events per drain%s\n",file,conv->map->npairs,stream,drain,conv->bundle?", bundled":"");
+
+    //run it once so the first bundles etc. don't count as allocations
+    feed_pos = 0;
+    feed_end = nmsgs < 1000 ? nmsgs : 1000;
+    convert_midi_in(NULL,conv);
+    conv->osc_sent = conv->osc_datagrams = nbytes = 0;
+
+    allocs = ALLOCS;
+    t0 = now();
+    for(feed_pos=0; feed_pos<nmsgs; )
+    {
+        feed_end = feed_pos+drain < nmsgs ? feed_pos+drain : nmsgs;
+        convert_midi_in(NULL,conv);
+    }
+    t = now()-t0;
+    allocs = ALLOCS-allocs;
+    printf("  %-16s %i\n","events",nmsgs);
+    printf("  %-16s %.0f\n","events/s",nmsgs/t);
+    printf("  %-16s %.2f\n","osc/event",(double)conv->osc_sent/nmsgs);
+    printf("  %-16s %.2f\n","datagrams/event",(double)conv->osc_datagrams/nmsgs);
+    printf("  %-16s %.1f\n","bytes/event",(double)nbytes/nmsgs);
+    printf("  %-16s %.2f\n","allocs/event",allocs/nmsgs);
+
+    //latency of each event
+    lat = malloc(sizeof(float)*nmsgs);
+    t0 = now();
+    for(i=0; i<1000; i++)
+        now();
+    overhead = (now()-t0)/1000;
+    for(i=0; i<nmsgs; i++)
+    {
+        feed_pos = i;
+        feed_end = i+1;
+        t0 = now();
+        convert_midi_in(NULL,conv);
+        lat[i] = (now()-t0-overhead)*1e9;
+    }
+    qsort(lat,nmsgs,sizeof(float),cmp_float);
+    printf("  %-16s p50 %.0f  p90 %.0f  p99 %.0f  p99.9 %.0f  max %.0f\n","latency ns",
+           lat[nmsgs/2],lat[nmsgs*9/10],lat[nmsgs*99/100],lat[(int)(nmsgs*0.999)],lat[nmsgs-1]);
+    free(lat);
+    free(feed);
+    free_map(conv);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    int i, n, nmsgs = 200000, use_micro = 0, use_map = 0;
+    char rules[200] = "10,100,500,1000,2000,5000";
+    char map[200] = MAPDIR "/default.omm";
+    char *corpus = NULL, *dump = NULL, *stream = NULL, *reply = NULL;
+    int drain = 16, nthreads = 0;
+    char file[] = "/tmp/osc2midi-bench-XXXXXX";
+    char *tok, *end;
+    CONVERTER conv;
+
+    memset(&conv,0,sizeof(conv));
+    plain = lo_message_new();
+    conv.multi_match = 1;
+    conv.glob_vel = 100;
+    for(i=1; i<argc; i++)
+    {
+        if(strcmp(argv[i], "-rules") == 0 && argv[i+1])
+            strcpy(rules,argv[++i]);
+        else if(strcmp(argv[i], "-msgs") == 0 && argv[i+1])
+            nmsgs = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-micro") == 0)
+            use_micro = 1;
+        else if(strcmp(argv[i], "-m") == 0 && argv[i+1])
+        {
+            strcpy(map,argv[++i]);
+            use_map = 1;
+        }
+        else if(strcmp(argv[i], "-corpus") == 0 && argv[i+1])
+            corpus = argv[++i];
+        else if(strcmp(argv[i], "-dump") == 0 && argv[i+1])
+            dump = argv[++i];
+        else if(strcmp(argv[i], "-o") == 0 && argv[i+1])
+        {
+            if(!(midi_out = fopen(argv[++i],"w")))
+            {
+                printf("Error opening %s!\n",argv[i]);
+                return -1;
+            }
+        }
+        else if(strcmp(argv[i], "-single") == 0)
+            conv.multi_match = 0;
+        else if(strcmp(argv[i], "-midi") == 0 && argv[i+1])
+            stream = argv[++i];
+        else if(strcmp(argv[i], "-drain") == 0 && argv[i+1])
+            drain = atoi(argv[++i]) > 0 ? atoi(argv[i]) : 1;
+        else if(strcmp(argv[i], "-bundle") == 0)
+            conv.bundle = 1;
+        else if(strcmp(argv[i], "-threads") == 0 && argv[i+1])
+            nthreads = atoi(argv[++i]) > 0 ? atoi(argv[i]) : 1;
+        else if(strcmp(argv[i], "-reply") == 0 && argv[i+1])
+            reply = argv[++i];
+        else
+        {
+            usage();
+            return strcmp(argv[i], "-h") ? -1 : 0;
+        }
+    }
+    if(use_micro)
+        return micro(map,nmsgs);
+    if(reply)
+        return check_reply(&conv,map,reply);
+    if(stream)
+        return run_midi(&conv,map,stream,nmsgs,drain);
+    if(nthreads)
+        return run_threads(&conv,map,corpus,nmsgs,nthreads);
+    if(use_map)
+        return run_map(&conv,map,corpus,dump,nmsgs);
+    close(mkstemp(file));
+
+    printf("%8s %16s %16s %12s\n","rules","indexed msg/s","scan msg/s","midi/msg");
+    for(tok = rules; *tok; tok = *end ? end+1 : end)
+    {
+        char (*paths)[64];
+        double indexed, scan;
+        n = strtol(tok,&end,10);
+        if(n <= 0)
+            continue;
+        paths = malloc(64*n);
+        if(gen_map(file,n,paths) || load_map(&conv,file) != n)
+        {
+            printf("Error generating map with %i rules!\n",n);
+            unlink(file);
+            return -1;
+        }
+        nqueued = 0;
+        indexed = run(&conv,paths,n,nmsgs,0);
+        scan = run(&conv,paths,n,nmsgs/10+1,1);
+        printf("%8i %16.0f %16.0f %12.2f\n",n,indexed,scan,(double)nqueued/(nmsgs+nmsgs/10+1));
+        free_map(&conv);
+        free(paths);
+    }
+    unlink(file);
+    return 0;
+}
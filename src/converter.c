@@ -10,6 +10,7 @@
 #include<signal.h>
 #include<ctype.h>
 #include<unistd.h>//only for usleep
+#include<pthread.h>
 #include"pair.h"
 #include"oscserver.h"
 #include"converter.h"
@@ -44,13 +45,16 @@ void init_registers(float ***regs, int n)
 }
 
 
-int load_map(CONVERTER* conv, char* file)
+//reads the map file into a new pair set, NULL if it can't be read
+static PAIRSET* read_map(CONVERTER* conv, char* file)
 {
     int i;
     char path[200],line[400],prefix[400],*home;
     FILE* map = NULL;
     FILE* tmp = NULL;
     PAIRHANDLE *p;
+    PAIRSET* set;
+    table tab;
     int use_stdin = strcmp(file, "-") == 0;
 
     //try to load the file:
@@ -119,7 +123,7 @@ int load_map(CONVERTER* conv, char* file)
         printf("Error opening map file! %s",path);
         fflush(stdout);
         printf("\b\b\b\n");
-        return -1;
+        return NULL;
     }
     if(conv->verbose)
         printf("Using map file %s\n",path);
@@ -128,7 +132,7 @@ int load_map(CONVERTER* conv, char* file)
     if(use_stdin && !(tmp = tmpfile()))
     {
         printf("Error opening temporary file!\n");
-        return -1;
+        return NULL;
     }
 
     //count how many lines there are
@@ -142,10 +146,11 @@ int load_map(CONVERTER* conv, char* file)
     }
     if (use_stdin) map = tmp;
 
+    set = (PAIRSET*)calloc(1, sizeof(PAIRSET));
     p = (PAIRHANDLE*)malloc(sizeof(PAIRHANDLE)*i);
     //initialize the register table (cf. pair.c) -ag
-    init_registers(&conv->registers,i);
-    conv->tab = init_table();
+    init_registers(&set->registers,i);
+    tab = init_table();
     int nkeys = 0;
     rewind(map);
     i=0;
@@ -181,7 +186,7 @@ int load_map(CONVERTER* conv, char* file)
                 }
                 strcpy(rule, line);
             }
-            p[i] = alloc_pair(rule, conv->tab, conv->registers, &nkeys);
+            p[i] = alloc_pair(rule, tab, set->registers, &nkeys);
             if(p[i++])
             {
                 if(conv->verbose)
@@ -192,19 +197,193 @@ int load_map(CONVERTER* conv, char* file)
             }
             else
             {
-                conv->errors++;
+                set->errors++;
                 i--;//error message will be printed by alloc_pair
             }
         }
     }
-    free_table(conv->tab);
+    free_table(tab);
+    if(use_stdin)
+        fclose(tmp);
+    else
+        fclose(map);
     if(conv->verbose)
     {
         printf("%i pairs created.\n",i);
     }
-    conv->npairs = i;
-    conv->p = p;
-    return i;
+    set->npairs = i;
+    set->p = p;
+    set->nkeys = nkeys;
+    set->osc_index = build_osc_index(p, i);
+    set->midi_index = build_midi_index(p, i);
+    set->bundled = (uint32_t*)calloc(i+1, sizeof(uint32_t));
+    set->osc_hits = (unsigned long*)calloc(i+1, sizeof(unsigned long));
+    set->throttled = (unsigned long*)calloc(i+1, sizeof(unsigned long));
+    set->midi_hits = (unsigned long*)calloc(i+1, sizeof(unsigned long));
+    return set;
+}
+
+static void free_pairset(PAIRSET* set)
+{
+    int i;
+    for(i=0; i<set->npairs; i++)
+        free_pair(set->p[i]);
+    for(i=0; i<set->nkeys; i++)
+        free(set->registers[i]);
+    free(set->registers);
+    free(set->p);
+    free_osc_index(set->osc_index);
+    free_midi_index(set->midi_index);
+    free(set->bundled);
+    free(set->osc_hits);
+    free(set->throttled);
+    free(set->midi_hits);
+    free(set);
+}
+
+//tells apart the maps a thread may have read
+static uint32_t map_serial = 0;
+
+int load_map(CONVERTER* conv, char* file)
+{
+    PAIRSET* set = read_map(conv, file);
+
+    if(!set)
+        return -1;
+    conv->errors += set->errors;
+    conv->map = set;
+    strncpy(conv->map_file, file, sizeof(conv->map_file)-1);
+    conv->map_file[sizeof(conv->map_file)-1] = 0;
+    memset(conv->map_readers, 0, sizeof(conv->map_readers));
+    conv->nreaders = 0;
+    conv->map_serial = __atomic_add_fetch(&map_serial, 1, __ATOMIC_RELAXED);
+    conv->map_shared = 0;
+    conv->reloading = 0;
+    memset(&conv->stats, 0, sizeof(STATS));
+    conv->bundle_serial = 1;
+    return set->npairs;
+}
+
+void free_map(CONVERTER* conv)
+{
+    free_pairset(conv->map);
+    conv->map = NULL;
+}
+
+/* Reloading the map (SIGHUP or /osc2midi/reload) reads it into a whole new
+   PAIRSET on a thread of its own and then swaps conv->map, so the midi ports
+   and their connections stay and no message is held up or dropped: each one
+   is converted with either the old map or the new one.
+
+   The old set can only be freed once nothing uses it anymore. Every thread
+   that converts has a counter in map_readers that it makes odd for as long
+   as it uses the map (map_enter() to map_exit()). After the swap the reload
+   thread waits until each counter that was odd has moved on; whoever enters
+   after the swap gets the new set. Readers never wait for anything, it's
+   only the reload that waits, which is why it has its own thread.
+
+   A thread mustn't call map_enter() again before its map_exit(). Threads
+   beyond MAP_READERS share map_shared, a plain count of them. */
+
+//this thread's slot in map_readers
+static __thread CONVERTER* reader_conv = NULL;
+static __thread uint32_t reader_serial = 0;
+static __thread int reader_slot = -1;
+
+PAIRSET* map_enter(CONVERTER* conv)
+{
+    if(reader_conv != conv || reader_serial != conv->map_serial)
+    {
+        reader_conv = conv;
+        reader_serial = conv->map_serial;
+        //seq_cst too, map_quiesce() only waits on the slots it counts
+        reader_slot = __atomic_fetch_add(&conv->nreaders, 1, __ATOMIC_SEQ_CST);
+    }
+    if(reader_slot < MAP_READERS)
+    {
+        //seq_cst so the reload can't miss it and still free what we load
+        __atomic_store_n(&conv->map_readers[reader_slot], conv->map_readers[reader_slot]+1, __ATOMIC_SEQ_CST);
+    }
+    else
+        __atomic_fetch_add(&conv->map_shared, 1, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&conv->map, __ATOMIC_SEQ_CST);
+}
+
+void map_exit(CONVERTER* conv)
+{
+    if(reader_slot < MAP_READERS)
+        __atomic_store_n(&conv->map_readers[reader_slot], conv->map_readers[reader_slot]+1, __ATOMIC_RELEASE);
+    else
+        __atomic_fetch_sub(&conv->map_shared, 1, __ATOMIC_RELEASE);
+}
+
+//wait until no thread can still be using a set that was swapped out
+static void map_quiesce(CONVERTER* conv)
+{
+    int i, n;
+    uint32_t seen[MAP_READERS];
+
+    n = __atomic_load_n(&conv->nreaders, __ATOMIC_SEQ_CST);
+    if(n > MAP_READERS)
+        n = MAP_READERS;
+    for(i=0; i<n; i++)
+        seen[i] = __atomic_load_n(&conv->map_readers[i], __ATOMIC_SEQ_CST);
+    for(i=0; i<n; i++)
+    {
+        while((seen[i] & 1) && __atomic_load_n(&conv->map_readers[i], __ATOMIC_ACQUIRE) == seen[i])
+            usleep(1000);
+    }
+    while(__atomic_load_n(&conv->map_shared, __ATOMIC_ACQUIRE))
+        usleep(1000);
+}
+
+static void* reload_thread(void* arg)
+{
+    CONVERTER* conv = (CONVERTER*)arg;
+    PAIRSET* set;
+    PAIRSET* old;
+
+    printf("reloading map %s\n", conv->map_file);
+    set = NULL;
+    if(!strcmp(conv->map_file, "-"))
+        printf("The map was read from stdin, it can't be reloaded.\n");
+    else
+        set = read_map(conv, conv->map_file);
+    if(set && set->errors)
+    {
+        printf("Found %d error(s), keeping the old map\n", set->errors);
+        free_pairset(set);
+        set = NULL;
+    }
+    if(set)
+    {
+        if(check_pair_set_for_filter(set->p, set->npairs) && !conv->seq.usefilter)
+            printf("The new map has filter functions, they need a restart to get a midi filter.\n");
+        old = __atomic_exchange_n(&conv->map, set, __ATOMIC_SEQ_CST);
+        map_quiesce(conv);
+        free_pairset(old);
+        printf("map reloaded, %i pairs\n", set->npairs);
+    }
+    fflush(stdout);
+    __atomic_store_n(&conv->reloading, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+//start reloading the map in the background, returns 0 if it can't now
+int request_reload(CONVERTER* conv)
+{
+    pthread_t thread;
+
+    if(__atomic_exchange_n(&conv->reloading, 1, __ATOMIC_ACQ_REL))
+        return 0;//already at it
+    if(pthread_create(&thread, NULL, reload_thread, conv))
+    {
+        printf("Could not start the thread to reload the map.\n");
+        __atomic_store_n(&conv->reloading, 0, __ATOMIC_RELEASE);
+        return 0;
+    }
+    pthread_detach(thread);
+    return 1;
 }
 
 static int missing_arg(const char *opt)
@@ -227,6 +406,12 @@ int process_cli_args(int argc, char** argv, char* file, char* port, char* addr,
     conv->mon_mode = 0;
     conv->multi_match = 1;
     conv->strict_match = 0;
+    conv->bundle = 0;
+    conv->workers = 1;
+    conv->osc_sent = 0;
+    conv->osc_datagrams = 0;
+    conv->send_message = lo_send_message;
+    conv->send_bundle = lo_send_bundle;
     conv->glob_chan = 0;
     conv->glob_vel = 100;
     conv->filter = 0;
@@ -234,6 +419,12 @@ int process_cli_args(int argc, char** argv, char* file, char* port, char* addr,
     conv->seq.useout = 1;
     conv->seq.usein = 1;
     conv->seq.usefilter = 0;
+    conv->seq.drv = NULL;
+    conv->seq.latency = 0;
+    conv->seq.overflow = MIDI_DROP_NEWEST;
+    conv->seq.merge = 0;
+    conv->seq.dedup = 0;
+    conv->seq.print_cycles = 0;
 
     if(argc>1)
     {
@@ -254,6 +445,19 @@ int process_cli_args(int argc, char** argv, char* file, char* port, char* addr,
                 //strict matches
                 conv->strict_match = 1;
             }
+            else if(strcmp(argv[i], "-bundle") ==0)
+            {
+                //bundle midi->osc messages
+                conv->bundle = 1;
+            }
+            else if (strcmp(argv[i], "-workers") == 0)
+            {
+                if (!argv[i+1]) return missing_arg(argv[i]);
+                //parallel osc receive threads
+                conv->workers = atoi(argv[++i]);
+                if (conv->workers < 1)
+                    conv->workers = 1;
+            }
             else if (strcmp(argv[i], "-map") == 0)
             {
                 if (!argv[i+1]) return missing_arg(argv[i]);
@@ -327,6 +531,55 @@ int process_cli_args(int argc, char** argv, char* file, char* port, char* addr,
                 conv->seq.usefilter = 1;
                 conv->seq.filter = &conv->filter;
             }
+            else if (strcmp(argv[i], "-backend") == 0)
+            {
+                if (!argv[i+1]) return missing_arg(argv[i]);
+                //midi driver
+                conv->seq.drv = find_midi_driver(argv[++i]);
+                if (!conv->seq.drv)
+                {
+                    printf("Unknown midi backend! %s\n",argv[i]);
+                    return -1;
+                }
+            }
+            else if (strcmp(argv[i], "-dejitter") == 0)
+            {
+                if (!argv[i+1]) return missing_arg(argv[i]);
+                //fixed output latency
+                conv->seq.latency = atoi(argv[++i]);
+            }
+            else if (strcmp(argv[i], "-overflow") == 0)
+            {
+                if (!argv[i+1]) return missing_arg(argv[i]);
+                //what to drop when the midi queues are full
+                i++;
+                if (strcmp(argv[i], "newest") == 0)
+                    conv->seq.overflow = MIDI_DROP_NEWEST;
+                else if (strcmp(argv[i], "oldest") == 0)
+                    conv->seq.overflow = MIDI_DROP_OLDEST;
+                else if (strcmp(argv[i], "coalesce") == 0)
+                    conv->seq.overflow = MIDI_COALESCE;
+                else
+                {
+                    printf("Unknown overflow policy! %s\n",argv[i]);
+                    return -1;
+                }
+            }
+            else if (strcmp(argv[i], "-merge") == 0)
+            {
+                //last controller value of each period only
+                conv->seq.merge = 1;
+            }
+            else if (strcmp(argv[i], "-dedup") == 0)
+            {
+                //don't send a controller value again
+                conv->seq.dedup = 1;
+            }
+            else if (strcmp(argv[i], "-cycles") == 0)
+            {
+                //driver cycle timings when quitting
+                conv->seq.print_cycles = 1;
+            }
             else if (strcmp(argv[i], "-name") == 0)
             {
                 if (!argv[i+1]) return missing_arg(argv[i]);
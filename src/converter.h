@@ -9,6 +9,30 @@
 #include"pair.h"
 #include"midiseq.h"
 #include"hashtable.h"
+#include"dispatch.h"
+#include"stats.h"
+
+//threads that can convert at the same time: the ones queueing midi and the
+//one converting midi to osc
+#define MAP_READERS (MIDI_PRODUCERS+1)
+
+//everything made from the map file, replaced as a whole when it's reloaded
+typedef struct _PAIRSET
+{
+    uint16_t npairs;
+    PAIRHANDLE* p;
+    OSC_INDEX osc_index;
+    MIDI_INDEX midi_index;
+
+    float** registers;
+    int nkeys;
+
+    uint32_t* bundled;  //bundle_serial of the bundle each pair's message is in
+    unsigned long* osc_hits;  //for each pair, osc->midi matches that sent something
+    unsigned long* throttled; //for each pair, osc->midi matches left out by @ or ~
+    unsigned long* midi_hits; //for each pair, midi->osc matches
+    int errors;         //lines that couldn't be read
+} PAIRSET;
 
 typedef struct _CONVERTER
 {
@@ -19,20 +43,42 @@ typedef struct _CONVERTER
     bool mon_mode;
     bool multi_match;
     bool strict_match;
+    bool bundle;     //send the osc messages from one drain of the midi queue as bundles
+    int workers;     //osc receive threads (SO_REUSEPORT sockets) if more than 1
     int8_t  convert; //0 = both, 1 = o2m, -1 = m2o
     bool dry_run;
     int errors;
 
-    uint16_t npairs;
-    PAIRHANDLE* p;
+    //swapped when the map is reloaded, while osc2midi runs get it with
+    //map_enter() and let go with map_exit(), see converter.c
+    PAIRSET* map;
+    char map_file[200];
+    uint32_t map_readers[MAP_READERS];//odd while the reader is using the map
+    int nreaders;
+    uint32_t map_serial;
+    unsigned long map_shared;//readers that didn't get a slot of their own
+    int reloading;
 
-    table tab;
-    float** registers;
+    //midi->osc bundling
+    uint32_t bundle_serial;
+    unsigned long osc_sent;      //osc messages sent
+    unsigned long osc_datagrams; //and the datagrams it took
+
+    STATS stats;    //read over osc with /osc2midi/stats
+
+    //where midi->osc messages go, lo_send_message and lo_send_bundle unless
+    //something else (e.g. the benchmark) wants to capture them
+    int (*send_message)(lo_address targ, const char* path, lo_message msg);
+    int (*send_bundle)(lo_address targ, lo_bundle b);
 
     MIDI_SEQ seq;
 } CONVERTER;
 
 int load_map(CONVERTER* conv, char* file);
+void free_map(CONVERTER* conv);
+PAIRSET* map_enter(CONVERTER* conv);
+void map_exit(CONVERTER* conv);
+int request_reload(CONVERTER* conv);
 int is_empty(const char *s);
 void init_registers(float ***regs, int n);
 int process_cli_args(int argc, char** argv, char* file, char* port, char* addr, char* clientname, CONVERTER* conv);
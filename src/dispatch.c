@@ -0,0 +1,256 @@
+//dispatch.c
+
+//indexes over the pair set for the osc and midi converters
+
+/* Every rule can only ever match messages with a known literal path (or path
+   prefix, if the path has variables like /multi/{i} in it) and a known type
+   string, so instead of running try_match_osc() on the whole map for each
+   incoming message, the pairs are put into a hash table keyed by exactly
+   those two strings while the map is loaded:
+
+     E<path>,<types>      for paths without variables
+     T<prefix>,<types>    for paths with variables, prefix is the literal part
+                          in front of the first {i}
+
+   Since the types of a rule only need to be a prefix of the types of the
+   message (see try_match_osc), and a path variable can start wherever an
+   integer can start in the incoming path, a lookup tries all type prefixes
+   for the exact path and for each place an integer could begin. That is a
+   handful of hash lookups per message no matter how many rules are loaded.
+   Each bucket keeps its pair indices in map order and the lists found are
+   merged on the fly, so multi and single mode see the candidates in the same
+   order as a full scan would.
+
+   The midi side is simpler, a rule can only match a fixed set of status
+   bytes (opcode and channel) and first data bytes (note or controller
+   number), so there is a table with one cell per status byte/data byte
+   combination holding the pairs that could match it, again in map order.
+   Rules which use a variable channel or controller are just put into every
+   cell they could match. */
+
+#include<stdlib.h>
+#include<string.h>
+#include<ctype.h>
+#include"dispatch.h"
+#include"ht_stuff.h"
+
+//one cell per status byte 0x80-0xFF and first data byte
+#define MIDI_CELLS (128*128)
+#define MIDI_CELL(status,data1) ((((status)&0x7F)<<7) | ((data1)&0x7F))
+
+//paths are limited to 200 chars and types to 100 when parsing the map
+#define KEYSZ 512
+
+struct _OSC_INDEX
+{
+    table tab;
+    int npairs;
+};
+
+struct _MIDI_INDEX
+{
+    uint32_t start[MIDI_CELLS+1];//pairs of cell c are start[c] to start[c+1]
+    uint16_t* pairs;
+};
+
+typedef struct _OSC_BUCKET
+{
+    char* key;
+    int n;
+    int size;
+    uint16_t* pairs;//in map order
+} OSC_BUCKET;
+
+static ht_key bucket_key(ht_elem e)
+{
+    return ((OSC_BUCKET*)e)->key;
+}
+
+static void bucket_free(ht_elem e)
+{
+    OSC_BUCKET* b = (OSC_BUCKET*)e;
+    free(b->key);
+    free(b->pairs);
+    free(b);
+}
+
+OSC_INDEX build_osc_index(PAIRHANDLE* pa, int npairs)
+{
+    int i;
+    char key[KEYSZ];
+    OSC_BUCKET* b;
+    OSC_INDEX ix = (OSC_INDEX)malloc(sizeof(struct _OSC_INDEX));
+
+    ix->npairs = npairs;
+    ix->tab = table_new(2*npairs+3, bucket_key, ht_equal, ht_hash);
+    for(i=0; i<npairs; i++)
+    {
+        key[0] = get_pair_osc_prefix(pa[i], key+1) ? 'T' : 'E';
+        strcat(key, ",");
+        strcat(key, get_pair_types(pa[i]));
+        b = (OSC_BUCKET*)table_search(ix->tab, key);
+        if(!b)
+        {
+            b = (OSC_BUCKET*)calloc(1, sizeof(OSC_BUCKET));
+            b->key = strdup(key);
+            table_insert(ix->tab, b);
+        }
+        if(b->n == b->size)
+        {
+            b->size = b->size ? 2*b->size : 4;
+            b->pairs = (uint16_t*)realloc(b->pairs, sizeof(uint16_t)*b->size);
+        }
+        b->pairs[b->n++] = i;
+    }
+    return ix;
+}
+
+void free_osc_index(OSC_INDEX ix)
+{
+    table_free(ix->tab, bucket_free);
+    free(ix);
+}
+
+//add the buckets for the first n chars of key with every prefix of types
+//returns -1 if the iterator is full
+static int add_buckets(OSC_INDEX ix, const char* key, int n, const char* types, int ntypes, OSC_ITER* it)
+{
+    int t;
+    char buf[KEYSZ];
+    OSC_BUCKET* b;
+
+    memcpy(buf, key, n);
+    buf[n++] = ',';
+    for(t=0; t<=ntypes; t++)
+    {
+        buf[n+t] = 0;
+        if( (b = (OSC_BUCKET*)table_search(ix->tab, buf)) )
+        {
+            if(it->n == OSC_ITER_MAX)
+                return -1;
+            it->cur[it->n] = b->pairs;
+            it->end[it->n++] = b->pairs + b->n;
+        }
+        buf[n+t] = types[t];
+    }
+    return 0;
+}
+
+void osc_index_find(OSC_INDEX ix, const char* path, const char* types, OSC_ITER* it)
+{
+    int k;
+    int len = strlen(path);
+    int ntypes = strlen(types);
+    char key[KEYSZ];
+
+    it->n = 0;
+    it->scan = -1;
+    it->npairs = ix->npairs;
+    if(len + ntypes + 3 > KEYSZ)
+    {
+        //can't be in the index anyway, but let try_match_osc decide
+        it->scan = 0;
+        return;
+    }
+
+    memcpy(key+1, path, len);
+    key[0] = 'E';
+    if(add_buckets(ix, key, len+1, types, ntypes, it))
+    {
+        it->n = 0;
+        it->scan = 0;
+        return;
+    }
+    //a path variable may begin anywhere sscanf could start reading an int
+    key[0] = 'T';
+    for(k=0; k<len; k++)
+    {
+        if(isdigit(path[k]) || isspace(path[k]) || path[k] == '-' || path[k] == '+')
+        {
+            if(add_buckets(ix, key, k+1, types, ntypes, it))
+            {
+                it->n = 0;
+                it->scan = 0;
+                return;
+            }
+        }
+    }
+}
+
+//returns the index of the next candidate pair, or -1 when there are no more
+int osc_iter_next(OSC_ITER* it)
+{
+    int i, best = -1;
+
+    if(it->scan >= 0)
+        return it->scan < it->npairs ? it->scan++ : -1;
+    for(i=0; i<it->n; i++)
+    {
+        if(it->cur[i] < it->end[i] && (best < 0 || *it->cur[i] < *it->cur[best]))
+            best = i;
+    }
+    if(best < 0)
+        return -1;
+    return *it->cur[best]++;
+}
+
+//call f for every cell pair i could match
+static void midi_cells(MIDI_INDEX ix, PAIRHANDLE ph, uint16_t i, void (*f)(MIDI_INDEX, int, uint16_t))
+{
+    int j,s,d,n;
+    uint8_t smin[2], smax[2], dmin, dmax;
+
+    n = get_pair_midi_keys(ph, smin, smax, &dmin, &dmax);
+    for(j=0; j<n; j++)
+        for(s=smin[j]; s<=smax[j]; s++)
+            for(d=dmin; d<=dmax; d++)
+                f(ix, MIDI_CELL(s,d), i);
+}
+
+static void count_cell(MIDI_INDEX ix, int c, uint16_t i)
+{
+    ix->start[c+1]++;
+}
+
+static void fill_cell(MIDI_INDEX ix, int c, uint16_t i)
+{
+    ix->pairs[ix->start[c]++] = i;
+}
+
+MIDI_INDEX build_midi_index(PAIRHANDLE* pa, int npairs)
+{
+    int i;
+    MIDI_INDEX ix = (MIDI_INDEX)calloc(1, sizeof(struct _MIDI_INDEX));
+
+    //count the pairs in each cell, then lay the cells out back to back
+    for(i=0; i<npairs; i++)
+        midi_cells(ix, pa[i], i, count_cell);
+    for(i=0; i<MIDI_CELLS; i++)
+        ix->start[i+1] += ix->start[i];
+    ix->pairs = (uint16_t*)malloc(sizeof(uint16_t)*(ix->start[MIDI_CELLS]+1));
+    //filling moves each start to the end of its cell, i.e. the next start
+    for(i=0; i<npairs; i++)
+        midi_cells(ix, pa[i], i, fill_cell);
+    for(i=MIDI_CELLS; i>0; i--)
+        ix->start[i] = ix->start[i-1];
+    ix->start[0] = 0;
+    return ix;
+}
+
+void free_midi_index(MIDI_INDEX ix)
+{
+    free(ix->pairs);
+    free(ix);
+}
+
+//get the candidate pairs for a midi message in map order, returns how many
+int midi_index_find(MIDI_INDEX ix, const uint8_t msg[], const uint16_t** pairs)
+{
+    int c;
+
+    if(msg[0] < 0x80)
+        return 0;
+    c = MIDI_CELL(msg[0], msg[1]);
+    *pairs = ix->pairs + ix->start[c];
+    return ix->start[c+1] - ix->start[c];
+}
@@ -0,0 +1,39 @@
+//dispatch.h
+
+//indexes built over the pair set when a map is loaded, so that the
+//converters only have to try the pairs which could possibly match
+//see dispatch.c for more info
+
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include<stdint.h>
+#include"pair.h"
+
+//max number of candidate lists merged for one message, if an incoming path
+//needs more lookups than this we just fall back to checking every pair
+#define OSC_ITER_MAX 32
+
+typedef struct _OSC_INDEX* OSC_INDEX;
+typedef struct _MIDI_INDEX* MIDI_INDEX;
+
+//walks over the candidate pairs for an osc message in map order
+typedef struct _OSC_ITER
+{
+    int n;                              //number of candidate lists
+    const uint16_t* cur[OSC_ITER_MAX];  //next pair index in each list
+    const uint16_t* end[OSC_ITER_MAX];
+    int scan;                           //next pair when doing a full scan (-1 if not)
+    int npairs;
+} OSC_ITER;
+
+OSC_INDEX build_osc_index(PAIRHANDLE* pa, int npairs);
+void free_osc_index(OSC_INDEX ix);
+void osc_index_find(OSC_INDEX ix, const char* path, const char* types, OSC_ITER* it);
+int osc_iter_next(OSC_ITER* it);
+
+MIDI_INDEX build_midi_index(PAIRHANDLE* pa, int npairs);
+void free_midi_index(MIDI_INDEX ix);
+int midi_index_find(MIDI_INDEX ix, const uint8_t msg[], const uint16_t** pairs);
+
+#endif
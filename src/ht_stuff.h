@@ -9,6 +9,8 @@
 
 #include"hashtable.h"
 
+bool ht_equal(ht_key s1, ht_key s2);
+int ht_hash(ht_key s, int m);
 int strkey(table tab, char* path, char* argtypes, int* nkeys);
 table init_table();
 void free_table(table tab);
@@ -28,37 +28,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
-#include <sys/time.h>
 #include <unistd.h>
-#include <assert.h>
 #include <string.h>
-#include <sysexits.h>
 #include <errno.h>
+#include <time.h>
 #include <jack/jack.h>
 #include <jack/midiport.h>
-#include <jack/ringbuffer.h>
 #include "midiseq.h"
+#include "rtlog.h"
 
 
-typedef struct _MidiMessage
-{
-    jack_nframes_t	time;
-    int		len;	/* Length of MIDI message, in bytes. */
-    uint8_t	data[3];
-} MidiMessage;
-
-#define RINGBUFFER_SIZE		256*sizeof(MidiMessage)
-
-/* Will emit a warning if time between jack callbacks is longer than this. */
-#define MAX_TIME_BETWEEN_CALLBACKS	0.1
-
-/* Will emit a warning if execution of jack callback takes longer than this. */
-#define MAX_PROCESSING_TIME	0.01
-
 typedef struct _jackseq
 {
-    jack_ringbuffer_t *ringbuffer_out;
-    jack_ringbuffer_t *ringbuffer_in;
     jack_client_t	*jack_client;
     jack_port_t	*output_port;
     jack_port_t	*input_port;
@@ -70,93 +51,21 @@ typedef struct _jackseq
 //These functions operate in the JACK RT Thread
 ///////////////////////////////////////////////
 
-double
-get_time(void)
-{
-    double seconds;
-    int ret;
-    struct timeval tv;
-
-    ret = gettimeofday(&tv, NULL);
-
-    if (ret)
-    {
-        perror("gettimeofday");
-        exit(EX_OSERR);
-    }
-
-    seconds = tv.tv_sec + tv.tv_usec / 1000000.0;
-
-    return (seconds);
-}
-
-double
-get_delta_time(void)
-{
-    static double previously = -1.0;
-    double now;
-    double delta;
-
-    now = get_time();
-
-    if (previously == -1.0)
-    {
-        previously = now;
-
-        return (0);
-    }
-
-    delta = now - previously;
-    previously = now;
-
-    assert(delta >= 0.0);
-
-    return (delta);
-}
-
-
-double
-nframes_to_ms(jack_client_t* jack_client,jack_nframes_t nframes)
-{
-    jack_nframes_t sr;
-
-    sr = jack_get_sample_rate(jack_client);
-
-    assert(sr > 0);
-
-    return ((nframes * 1000.0) / (double)sr);
-}
-
-void
-queue_message(jack_ringbuffer_t* ringbuffer, MidiMessage *ev)
-{
-    int written;
-
-    if (jack_ringbuffer_write_space(ringbuffer) < sizeof(*ev))
-    {
-        printf("Not enough space in the ringbuffer, MIDI LOST.");
-        return;
-    }
-
-    written = jack_ringbuffer_write(ringbuffer, (char *)ev, sizeof(*ev));
-
-    if (written != sizeof(*ev))
-        printf("jack_ringbuffer_write failed, MIDI LOST.");
-}
-
-void
-process_midi_input(JACK_SEQ* seq,jack_nframes_t nframes)
+//these return how many events they handled
+int
+process_midi_input(MIDI_SEQ* mseq,jack_nframes_t nframes)
 {
+    JACK_SEQ* seq = (JACK_SEQ*)mseq->driver;
     int read, events, i;
     void *port_buffer;
-    MidiMessage rev;
     jack_midi_event_t event;
+    int queued = 0;
 
     port_buffer = jack_port_get_buffer(seq->input_port, nframes);
     if (port_buffer == NULL)
     {
-        printf("jack_port_get_buffer failed, cannot receive anything.");
-        return;
+        rtlog("jack_port_get_buffer failed, cannot receive anything.", 0, 0);
+        return 0;
     }
 
 #ifdef JACK_MIDI_NEEDS_NFRAMES
@@ -182,19 +91,20 @@ process_midi_input(JACK_SEQ* seq,jack_nframes_t nframes)
                 //not sysex or something
 
                 //PUSH ONTO CIRCULAR BUFFER
-                //not sure if its a true copy onto buffer, if not this won't work
-                rev.len = event.size;
-                rev.time = event.time;
-                memcpy(rev.data, event.buffer, rev.len);
-                queue_message(seq->ringbuffer_in,&rev);
+                push_midi_in(mseq, event.buffer, event.size, event.time);
+                queued++;
             }
         }
 
 
     }
+
+    if (queued)
+        notify_midi_in(mseq);
+    return queued;
 }
 
-void
+int
 process_midi_filter(MIDI_SEQ* mseq,jack_nframes_t nframes)
 {
     JACK_SEQ* seq = (JACK_SEQ*)mseq->driver;
@@ -208,14 +118,14 @@ process_midi_filter(MIDI_SEQ* mseq,jack_nframes_t nframes)
     inport_buffer = jack_port_get_buffer(seq->filter_in_port, nframes);
     if (inport_buffer == NULL)
     {
-        printf("jack_port_get_buffer failed, cannot receive anything.");
-        return;
+        rtlog("jack_port_get_buffer failed, cannot receive anything.", 0, 0);
+        return 0;
     }
     outport_buffer = jack_port_get_buffer(seq->filter_out_port, nframes);
     if (outport_buffer == NULL)
     {
-        printf("jack_port_get_buffer failed, cannot send anything.");
-        return;
+        rtlog("jack_port_get_buffer failed, cannot send anything.", 0, 0);
+        return 0;
     }
 
 #ifdef JACK_MIDI_NEEDS_NFRAMES
@@ -248,7 +158,7 @@ process_midi_filter(MIDI_SEQ* mseq,jack_nframes_t nframes)
 
             if (buffer == NULL)
             {
-                //warn_from_jack_thread_context("jack_midi_event_reserve failed, NOTE LOST.");
+                rtlog("jack_midi_event_reserve failed, note off %ld on the filter output LOST.", note, 0);
                 break;
             }
 
@@ -271,7 +181,7 @@ process_midi_filter(MIDI_SEQ* mseq,jack_nframes_t nframes)
 
             if (buffer == NULL)
             {
-                //warn_from_jack_thread_context("jack_midi_event_reserve failed, NOTE LOST.");
+                rtlog("jack_midi_event_reserve failed, note on %ld on the filter output LOST.", note, 0);
                 break;
             }
 
@@ -379,7 +289,7 @@ process_midi_filter(MIDI_SEQ* mseq,jack_nframes_t nframes)
 
             if (buffer == NULL)
             {
-                //warn_from_jack_thread_context("jack_midi_event_reserve failed, NOTE LOST.");
+                rtlog("jack_midi_event_reserve failed, %ld filter events LOST.", events-i, 0);
                 break;
             }
 
@@ -387,24 +297,26 @@ process_midi_filter(MIDI_SEQ* mseq,jack_nframes_t nframes)
         }
 
     }
+    return i;
 }
 
-void
-process_midi_output(JACK_SEQ* seq,jack_nframes_t nframes)
+int
+process_midi_output(MIDI_SEQ* mseq,jack_nframes_t nframes)
 {
-    int read, t;
+    JACK_SEQ* seq = (JACK_SEQ*)mseq->driver;
+    int len, t, sent = 0;
     uint8_t *buffer;
+    uint8_t data[3];
     void *port_buffer;
     jack_nframes_t last_frame_time;
-    MidiMessage ev;
 
     last_frame_time = jack_last_frame_time(seq->jack_client);
 
     port_buffer = jack_port_get_buffer(seq->output_port, nframes);
     if (port_buffer == NULL)
     {
-        printf("jack_port_get_buffer failed, cannot send anything.");
-        return;
+        rtlog("jack_port_get_buffer failed, cannot send anything.", 0, 0);
+        return 0;
     }
 
 #ifdef JACK_MIDI_NEEDS_NFRAMES
@@ -413,44 +325,24 @@ process_midi_output(JACK_SEQ* seq,jack_nframes_t nframes)
     jack_midi_clear_buffer(port_buffer);
 #endif
 
-    while (jack_ringbuffer_read_space(seq->ringbuffer_out))
+    while ((t = pop_midi_out(mseq, nframes, last_frame_time, data, &len)) >= 0)
     {
-        read = jack_ringbuffer_peek(seq->ringbuffer_out, (char *)&ev, sizeof(ev));
-
-        if (read != sizeof(ev))
-        {
-            //warn_from_jack_thread_context("Short read from the ringbuffer, possible note loss.");
-            jack_ringbuffer_read_advance(seq->ringbuffer_out, read);
-            continue;
-        }
-
-        t = ev.time + nframes - last_frame_time;
-
-        /* If computed time is too much into the future, we'll need
-           to send it later. */
-        if (t >= (int)nframes)
-            break;
-
-        /* If computed time is < 0, we missed a cycle because of xrun. */
-        if (t < 0)
-            t = 0;
-
-        jack_ringbuffer_read_advance(seq->ringbuffer_out, sizeof(ev));
-
 #ifdef JACK_MIDI_NEEDS_NFRAMES
-        buffer = jack_midi_event_reserve(port_buffer, t, ev.len, nframes);
+        buffer = jack_midi_event_reserve(port_buffer, t, len, nframes);
 #else
-        buffer = jack_midi_event_reserve(port_buffer, t, ev.len);
+        buffer = jack_midi_event_reserve(port_buffer, t, len);
 #endif
 
         if (buffer == NULL)
         {
-            //warn_from_jack_thread_context("jack_midi_event_reserve failed, NOTE LOST.");
+            rtlog("jack_midi_event_reserve failed at frame %ld, MIDI message 0x%02lx LOST.", t, data[0]);
             break;
         }
 
-        memcpy(buffer, ev.data, ev.len);
+        memcpy(buffer, data, len);
+        sent++;
     }
+    return sent;
 }
 
 // in, i+o, i+o+t, o+t, out
@@ -459,125 +351,54 @@ int
 process_callback(jack_nframes_t nframes, void *seqq)
 {
     MIDI_SEQ* mseq = (MIDI_SEQ*)seqq;
-    JACK_SEQ* seq = (JACK_SEQ*)mseq->driver;
-#ifdef MEASURE_TIME
-    if (get_delta_time() > MAX_TIME_BETWEEN_CALLBACKS)
-        printf("Had to wait too long for JACK callback; scheduling problem?");
-#endif
+    uint64_t start, t;
+    int events = 0;
 
+    start = t = begin_midi_cycle(mseq);
     if(mseq->usein)
-        process_midi_input( seq,nframes );
+    {
+        events += process_midi_input( mseq,nframes );
+        t = end_midi_stage(&mseq->cycles.in, t);
+    }
     if(mseq->usefilter)
-        process_midi_filter( mseq,nframes );
+    {
+        events += process_midi_filter( mseq,nframes );
+        t = end_midi_stage(&mseq->cycles.filter, t);
+    }
     if(mseq->useout)
-        process_midi_output( seq,nframes );
-
-#ifdef MEASURE_TIME
-    if (get_delta_time() > MAX_PROCESSING_TIME)
-        printf("Processing took too long; scheduling problem?");
-#endif
-
+    {
+        events += process_midi_output( mseq,nframes );
+        t = end_midi_stage(&mseq->cycles.out, t);
+    }
+    end_midi_cycle(mseq, start, t, events);
     return (0);
 }
 
+
 ///////////////////////////////////////////////
 //these functions are executed in other threads
 ///////////////////////////////////////////////
-void queue_midi(MIDI_SEQ* seqq, uint8_t msg[])
+static uint32_t jack_time(MIDI_SEQ* mseq)
 {
-    MidiMessage ev;
-    JACK_SEQ* seq = (JACK_SEQ*)seqq->driver;
-    ev.len = 3;
-
-    // At least with JackOSX, Jack will transmit the bytes verbatim, so make
-    // sure that we look at the status byte and trim the message accordingly,
-    // in order not to transmit any invalid MIDI data.
-    switch (msg[0] & 0xf0)
-    {
-    case 0x80:
-    case 0x90:
-    case 0xa0:
-    case 0xb0:
-    case 0xe0:
-        break; // 2 data bytes
-    case 0xc0:
-    case 0xd0:
-        ev.len = 2; // 1 data byte
-        break;
-    case 0xf0: // system message
-        switch (msg[0])
-        {
-        case 0xf2:
-            break; // 2 data bytes
-        case 0xf1:
-        case 0xf3:
-            ev.len = 2; // 1 data byte
-            break;
-        case 0xf6:
-        case 0xf8:
-        case 0xf9:
-        case 0xfa:
-        case 0xfb:
-        case 0xfc:
-        case 0xfe:
-        case 0xff:
-            ev.len = 1; // no data byte
-            break;
-        default:
-            // ignore unknown (most likely sysex)
-            return;
-        }
-        break;
-    default:
-        return; // not a valid MIDI message, bail out
-    }
-
-    ev.data[0] = msg[0];
-    ev.data[1] = msg[1];
-    ev.data[2] = msg[2];
-
-    ev.time = jack_frame_time(seq->jack_client);
-    queue_message(seq->ringbuffer_out,&ev);
+    JACK_SEQ* seq = (JACK_SEQ*)mseq->driver;
+    return jack_frame_time(seq->jack_client);
 }
 
-int pop_midi(MIDI_SEQ* seqq, uint8_t msg[])
+static uint32_t jack_rate(MIDI_SEQ* mseq)
 {
-    int read;
-    MidiMessage ev;
-    JACK_SEQ* seq = (JACK_SEQ*)seqq->driver;
-
-    if (jack_ringbuffer_read_space(seq->ringbuffer_in))
-    {
-        read = jack_ringbuffer_peek(seq->ringbuffer_in, (char *)&ev, sizeof(ev));
-
-        if (read != sizeof(ev))
-        {
-            //warn_from_jack_thread_context("Short read from the ringbuffer, possible note loss.");
-            jack_ringbuffer_read_advance(seq->ringbuffer_in, read);
-            return -1;
-        }
-
-        jack_ringbuffer_read_advance(seq->ringbuffer_in, sizeof(ev));
-
-        memcpy(msg,ev.data,ev.len);
-
-        return ev.len;
-    }
-    else
-        return 0;
+    JACK_SEQ* seq = (JACK_SEQ*)mseq->driver;
+    return jack_get_sample_rate(seq->jack_client);
 }
 
 ////////////////////////////////
 //this is run in the main thread
 ////////////////////////////////
-int
-init_midi_seq(MIDI_SEQ* mseq, uint8_t verbose, const char* clientname)
+static int
+jack_open(MIDI_SEQ* mseq, uint8_t verbose, const char* clientname)
 {
     int err;
     JACK_SEQ* seq;
 
-    mseq->nnotes = 0;
-    mseq->old_filter = 0;
     seq = (JACK_SEQ*)malloc(sizeof(JACK_SEQ));
     mseq->driver = seq;
     if(verbose)printf("opening client...\n");
@@ -595,56 +416,35 @@ init_midi_seq(MIDI_SEQ* mseq, uint8_t verbose, const char* clientname)
     if (err)
     {
         printf("Could not register JACK process callback.\n");
+        jack_client_close(seq->jack_client);
         free(seq);
         return 0;
     }
 
     if(mseq->usein)
     {
-
-        if(verbose)printf("initializing JACK input: \ncreating ringbuffer...\n");
-        seq->ringbuffer_in = jack_ringbuffer_create(RINGBUFFER_SIZE);
-
-        if (seq->ringbuffer_in == NULL)
-        {
-            printf("Cannot create JACK ringbuffer.\n");
-            free(seq);
-            return 0;
-        }
-
-        jack_ringbuffer_mlock(seq->ringbuffer_in);
-
+        if(verbose)printf("initializing JACK input...\n");
         seq->input_port = jack_port_register(seq->jack_client, "midi_in", JACK_DEFAULT_MIDI_TYPE,
                                              JackPortIsInput, 0);
 
         if (seq->input_port == NULL)
         {
             printf("Could not register JACK port.\n");
+            jack_client_close(seq->jack_client);
             free(seq);
             return 0;
         }
     }
     if(mseq->useout)
     {
-
-        if(verbose)printf("initializing JACK output: \ncreating ringbuffer...\n");
-        seq->ringbuffer_out = jack_ringbuffer_create(RINGBUFFER_SIZE);
-
-        if (seq->ringbuffer_out == NULL)
-        {
-            printf("Cannot create JACK ringbuffer.\n");
-            free(seq);
-            return 0;
-        }
-
-        jack_ringbuffer_mlock(seq->ringbuffer_out);
-
+        if(verbose)printf("initializing JACK output...\n");
         seq->output_port = jack_port_register(seq->jack_client, "midi_out", JACK_DEFAULT_MIDI_TYPE,
                                               JackPortIsOutput, 0);
 
         if (seq->output_port == NULL)
         {
             printf("Could not register JACK port.\n");
+            jack_client_close(seq->jack_client);
             free(seq);
             return 0;
         }
@@ -660,6 +460,7 @@ init_midi_seq(MIDI_SEQ* mseq, uint8_t verbose, const char* clientname)
         if (seq->filter_in_port == NULL || seq->filter_out_port == NULL)
         {
             printf("Could not register JACK port.\n");
+            jack_client_close(seq->jack_client);
             free(seq);
             return 0;
         }
@@ -668,16 +469,26 @@ init_midi_seq(MIDI_SEQ* mseq, uint8_t verbose, const char* clientname)
     if (jack_activate(seq->jack_client))
     {
         printf("Cannot activate JACK client.\n");
+        jack_client_close(seq->jack_client);
         free(seq);
         return 0;
     }
     return 1;
 }
 
-void close_midi_seq(MIDI_SEQ* mseq)
+static void jack_close(MIDI_SEQ* mseq)
 {
     JACK_SEQ* seq = (JACK_SEQ*)mseq->driver;
-    if(mseq->useout)jack_ringbuffer_free(seq->ringbuffer_out);
-    if(mseq->usein)jack_ringbuffer_free(seq->ringbuffer_in);
+    //the process callback is done with mseq once this returns
+    jack_client_close(seq->jack_client);
     free(seq);
 }
+
+const MIDI_DRIVER jack_driver =
+{
+    "jack",
+    jack_open,
+    jack_close,
+    jack_time,
+    jack_rate
+};
@@ -0,0 +1,145 @@
+//loopback.c
+
+//in-process midi driver, no jack server needed
+
+/* Runs the same cycle a jack client would, on its own thread woken up every
+   PERIOD frames at RATE: the output due in this cycle is taken out of the
+   output ring and, when there is midi input, pushed straight back into the
+   input ring as if it had been received at the same offset. So an osc2midi
+   with -backend loopback converts OSC->MIDI->OSC without anything outside of
+   the process, which is handy for tests and for profiling the converter
+   without jack's scheduling in the picture. */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<time.h>
+#include<pthread.h>
+#include<sched.h>
+#include"midiseq.h"
+
+#define RATE 48000
+#define PERIOD 256
+
+typedef struct _LOOPBACK
+{
+    pthread_t thread;
+    int running;
+    struct timespec start;  //frame 0
+    uint32_t cycle_start;   //first frame of the current cycle
+    unsigned long nout;     //messages that went through
+    unsigned long late;     //cycles that started a whole period late
+    uint8_t verbose;
+} LOOPBACK;
+
+static uint32_t loopback_time(MIDI_SEQ* seq)
+{
+    LOOPBACK* lb = (LOOPBACK*)seq->driver;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - lb->start.tv_sec)*RATE
+           + ((int64_t)now.tv_nsec - lb->start.tv_nsec)*RATE/1000000000;
+}
+
+static uint32_t loopback_rate(MIDI_SEQ* seq)
+{
+    return RATE;
+}
+
+static void* loopback_thread(void* arg)
+{
+    MIDI_SEQ* seq = (MIDI_SEQ*)arg;
+    LOOPBACK* lb = (LOOPBACK*)seq->driver;
+    struct timespec next = lb->start;
+    uint8_t data[3];
+    int t, len, events;
+    uint64_t start;
+
+    while(__atomic_load_n(&lb->running, __ATOMIC_ACQUIRE))
+    {
+        //sleep until the end of this period
+        next.tv_nsec += (long)PERIOD*1000000000/RATE;
+        if(next.tv_nsec >= 1000000000)
+        {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        start = begin_midi_cycle(seq);
+        lb->cycle_start += PERIOD;
+        if(loopback_time(seq) - lb->cycle_start >= 2*PERIOD)
+            lb->late++;
+
+        events = 0;
+        while(seq->useout &&
+                (t = pop_midi_out(seq, PERIOD, lb->cycle_start, data, &len)) >= 0)
+        {
+            lb->nout++;
+            events++;
+            if(seq->usein)
+                push_midi_in(seq, data, len, t);
+        }
+        //output and input are one stage here
+        if(events && seq->usein)
+            notify_midi_in(seq);
+        end_midi_cycle(seq, start, end_midi_stage(&seq->cycles.out, start), events);
+    }
+    return NULL;
+}
+
+static int loopback_open(MIDI_SEQ* seq, uint8_t verbose, const char* clientname)
+{
+    pthread_attr_t attr;
+    struct sched_param param;
+    LOOPBACK* lb = (LOOPBACK*)calloc(1, sizeof(LOOPBACK));
+
+    seq->driver = lb;
+    lb->verbose = verbose;
+    if(seq->usefilter)
+        printf("The midi filter is not supported by the loopback driver, ignoring it.\n");
+    if(verbose)printf("starting loopback thread, %d frames at %dHz...\n", PERIOD, RATE);
+
+    clock_gettime(CLOCK_MONOTONIC, &lb->start);
+    lb->running = 1;
+
+    //realtime like jack if we are allowed to, else just a normal thread
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    param.sched_priority = sched_get_priority_min(SCHED_FIFO) + 10;
+    pthread_attr_setschedparam(&attr, &param);
+    if(pthread_create(&lb->thread, &attr, loopback_thread, seq))
+    {
+        if(verbose)printf("no realtime priority for the loopback thread\n");
+        if(pthread_create(&lb->thread, NULL, loopback_thread, seq))
+        {
+            printf("Could not start the loopback thread.\n");
+            pthread_attr_destroy(&attr);
+            free(lb);
+            return 0;
+        }
+    }
+    pthread_attr_destroy(&attr);
+    return 1;
+}
+
+static void loopback_close(MIDI_SEQ* seq)
+{
+    LOOPBACK* lb = (LOOPBACK*)seq->driver;
+
+    __atomic_store_n(&lb->running, 0, __ATOMIC_RELEASE);
+    pthread_join(lb->thread, NULL);
+    if(lb->verbose || seq->print_cycles)
+        printf("loopback: %lu midi messages, %lu late cycles\n", lb->nout, lb->late);
+    free(lb);
+}
+
+const MIDI_DRIVER loopback_driver =
+{
+    "loopback",
+    loopback_open,
+    loopback_close,
+    loopback_time,
+    loopback_rate
+};
@@ -15,6 +15,8 @@
 #include"converter.h"
 #include"midiseq.h"
 #include"ht_stuff.h"
+#include"rtlog.h"
+#include"trace.h"
 
 #ifndef PREFIX
 #define PREFIX "/usr/local"
@@ -27,6 +29,13 @@ void quitter(int sig)
     quit = 1;
 }
 
+uint8_t reload = 0;
+
+void reloader(int sig)
+{
+    reload = 1;
+}
+
 void usage()
 {
     printf("osc2midi - a linux OSC to MIDI bridge\n");
@@ -46,11 +55,22 @@ void usage()
     printf("    -multi         multi mode (check all mappings/send multiple messages)\n");
     printf("    -single        multi mode off (stop checks after first match)\n");
     printf("    -strict        strict matches (check multiple occurrences of variables)\n");
+    printf("    -bundle        send the OSC messages for MIDI that arrives together as bundles\n");
+    printf("    -workers <value> receive and convert OSC on this many threads\n");
     printf("    -mon           only print OSC messages that come into the port\n");
     printf("    -o2m           only convert OSC messages to MIDI\n");
     printf("    -m2o           only convert MIDI messages to OSC\n");
     printf("    -n             dry run: check syntax of map file and exit\n");
+    printf("    -dejitter <value> add a fixed latency of value frames to the MIDI output\n");
+    printf("    -overflow <value> what to drop when a MIDI queue is full: newest (default),\n");
+    printf("                   oldest or coalesce\n");
+    printf("    -merge         send only the last value of each controller in a MIDI period\n");
+    printf("    -dedup         don't send a controller value again if it didn't change\n");
+    printf("    -cycles        print how long the MIDI driver's cycles took when quitting\n");
     printf("    -name <value>  midi client name (default osc2midi)\n");
+    printf("    -backend <value> midi driver (");
+    list_midi_drivers(", ");
+    printf(", default jack)\n");
     printf("    -h             show this message\n");
     printf("\n");
     printf("NOTES:\n");
@@ -65,6 +85,60 @@ void usage()
     printf("    matched to the same value when converting an OSC or MIDI message. This\n");
     printf("    incurs a small overhead and is disabled by default; -strict enables it.\n");
     printf("\n");
+    printf("    With -bundle all the OSC messages made from the MIDI messages waiting at\n");
+    printf("    the same time are sent in one bundle (split when it wouldn't fit in a\n");
+    printf("    single UDP datagram), instead of one datagram per message.\n");
+    printf("\n");
+    printf("    With -workers the OSC port is opened once per worker (SO_REUSEPORT) and\n");
+    printf("    the system spreads the clients over them, so many clients sending at\n");
+    printf("    once can use more than one core. Each client sticks to one worker.\n");
+    printf("\n");
+    printf("    MIDI from an OSC bundle with a timetag goes out at that time (as far as\n");
+    printf("    the clocks of sender and osc2midi agree) instead of when it arrived.\n");
+    printf("    Timetags more than 5 seconds ahead are taken as \"now\".\n");
+    printf("\n");
+    printf("    MIDI that arrives late (e.g. over bursty Wi-Fi) is sent as soon as\n");
+    printf("    possible. With -dejitter every message is held back by the same amount\n");
+    printf("    instead, so timing stays steady as long as nothing is later than that.\n");
+    printf("    One or two periods of the MIDI driver is a good start.\n");
+    printf("\n");
+    printf("    When a MIDI queue fills up (a burst bigger than the driver can take)\n");
+    printf("    -overflow decides what goes: the new message, the oldest one waiting, or\n");
+    printf("    with coalesce all but the newest value of each controller, pitchbend and\n");
+    printf("    channel pressure (but not data entry, (N)RPN and channel mode controllers,\n");
+    printf("    see -dedup). Note offs always get through, so no notes get stuck.\n");
+    printf("\n");
+    printf("    With -merge a controller, pitchbend or channel pressure that changes\n");
+    printf("    several times within one period of the MIDI driver is only sent with its\n");
+    printf("    last value. Notes and everything else are sent as they are, and so are\n");
+    printf("    data entry, (N)RPN and channel mode controllers (see -dedup). This saves\n");
+    printf("    bandwidth on DIN MIDI interfaces when faders send faster than that.\n");
+    printf("\n");
+    printf("    OSC faders move in much finer steps than MIDI's 128, so most of their\n");
+    printf("    messages give the same MIDI message as the last one. -dedup leaves out\n");
+    printf("    a controller, aftertouch or pitchbend that has the value it already\n");
+    printf("    had. Notes and other messages are always sent, and so are the\n");
+    printf("    controllers that are part of a sequence or a command: data entry and\n");
+    printf("    (N)RPN (CC 6, 38 and 96-101) and the channel mode messages (CC 120-127).\n");
+    printf("\n");
+    printf("    Paths starting with /osc2midi/ are not looked up in the map. Send\n");
+    printf("    /osc2midi/stats to get the counters and timings of a running osc2midi\n");
+    printf("    back (see the README for what is in the reply).\n");
+    printf("\n");
+    printf("    SIGHUP or /osc2midi/reload reads the map file again and swaps it in\n");
+    printf("    while running, the MIDI ports and their connections stay. Messages\n");
+    printf("    that come in meanwhile are converted with the old map. If the new one\n");
+    printf("    has errors the old one is kept. Registers start over at 0.\n");
+    printf("\n");
+    printf("    The MIDI driver's cycles (JACK's process callback) are always timed:\n");
+    printf("    the time between them, each stage and the events in each. -cycles (or\n");
+    printf("    -v) prints these when quitting, along with the share of the time that\n");
+    printf("    osc2midi took, which is its part of the DSP load.\n");
+    printf("\n");
+    printf("    The loopback backend needs no JACK server: it runs its own 256 frame\n");
+    printf("    period at 48kHz and feeds the MIDI output straight back to the input.\n");
+    printf("    It is meant for testing and profiling, the filter (-s) is JACK only.\n");
+    printf("\n");
 
     return;
 }
@@ -95,7 +169,7 @@ int main(int argc, char** argv)
         {
             printf("Found %d error(s)\n", conv.errors);
         }
-        if( (i = check_pair_set_for_filter(conv.p,conv.npairs)) )
+        if( (i = check_pair_set_for_filter(conv.map->p,conv.map->npairs)) )
         {
             conv.seq.usefilter = true;
             conv.seq.filter = &conv.filter;
@@ -105,11 +179,21 @@ int main(int argc, char** argv)
     else if(conv.verbose)
         printf("Monitor mode, incoming OSC messages will only be printed.\n");
 
+    //matches and monitored messages are printed on a thread of their own
+    if(conv.verbose || conv.mon_mode)
+        start_trace();
+
     //start the server
-    lo_server_thread st;
+    lo_server_thread st = NULL;
     if(conv.convert > -1)
     {
-        st = start_osc_server(port,&conv);
+        if(conv.workers > 1)
+        {
+            if(!start_osc_workers(port,&conv))
+                return -1;
+        }
+        else
+            st = start_osc_server(port,&conv);
         conv.seq.useout = true;
     }
     else
@@ -143,33 +227,59 @@ int main(int argc, char** argv)
     fflush(stdout);
 
     signal(SIGINT, quitter);
+    if(!conv.mon_mode)
+        signal(SIGHUP, reloader);
     while(!quit)
     {
+        if(reload)
+        {
+            //done on a thread of its own, conversions go on meanwhile
+            reload = 0;
+            request_reload(&conv);
+        }
         if(conv.convert < 1)
         {
             convert_midi_in(loaddr,&conv);
-            usleep(1000);
+            //sleeps until the jack thread has new midi for us
+            wait_midi(&conv.seq,100);
         }
         else
             usleep(50000);
+        //whatever the realtime thread had to say
+        rtlog_drain();
     }
 
     //stop everything
     printf("\nquitting...\n");
-    if(!conv.mon_mode)
+    //the osc server goes first, it queues midi
+    if(conv.convert > -1)
     {
         if(conv.verbose)
-            printf(" closing midi ports\n");
-        close_midi_seq(&conv.seq);
+            printf(" closing osc server\n");
+        if(st)
+            stop_osc_server(st);
+        else
+            stop_osc_workers(conv.verbose);
     }
-    if(conv.convert > -1)
+    //nothing is traced anymore
+    stop_trace();
+    if(!conv.mon_mode)
     {
         if(conv.verbose)
-            printf(" closing osc server\n");
-        stop_osc_server(st);
+            printf(" closing midi ports\n");
+        print_midi_rings(&conv.seq, conv.verbose);
+        close_midi_seq(&conv.seq);
+        rtlog_drain();
+        if(conv.verbose || conv.seq.latency || conv.seq.merge)
+            print_midi_timing(&conv.seq);
+        if(conv.verbose || conv.seq.print_cycles)
+            print_midi_cycles(&conv.seq);
     }
     if(conv.convert < 1)
     {
+        if(conv.bundle)
+            printf(" sent %lu osc messages in %lu datagrams (%lu saved by bundling)\n",
+                   conv.osc_sent, conv.osc_datagrams, conv.osc_sent - conv.osc_datagrams);
         lo_address_free(loaddr);
     }
     return 0;
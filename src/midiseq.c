@@ -0,0 +1,918 @@
+//midiseq.c
+
+//the part of the midi sequencer that doesn't depend on the backend: the
+//queues between the driver thread and the converter, and the scheduling of
+//the output
+
+/* The driver (jack, loopback, ...) runs a realtime thread that gets called
+   every period of nframes frames. In it the driver pushes the midi input
+   into ring_in with push_midi_in() and takes the output that is due in this
+   cycle from the ring_outs with pop_midi_out(). The other side of the rings
+   is the rest of the program, queue_midi() from the osc server thread(s)
+   and pop_midi() from the main loop.
+
+   Each ring has exactly one producer and one consumer so it's just a power
+   of 2 array with a head only the producer writes and a tail only the
+   consumer writes, no locks or syscalls involved. To keep it that way with
+   more than one thread queueing output, every thread gets a ring_out of its
+   own the first time it calls queue_midi().
+
+   Output can be queued for later (OSC bundles with a timetag), so messages
+   don't necessarily arrive in the order they are due, and the rings of the
+   different threads need to be merged anyway. The driver thread moves
+   everything in the ring_outs to the pending list, which is kept sorted by
+   time, and sends from there whatever falls in the current cycle. The rest
+   waits for a later cycle.
+
+   Normally a message goes out one period after it was queued, at the same
+   offset into the period as it arrived, unless it was late already (a
+   bundle whose time has passed, or the driver missed a cycle) and goes out
+   at the start of the period. With -dejitter every message gets a fixed
+   latency on top, so those that arrive late by less than that still go out
+   exactly when they should. The timing stats keep track of how late the
+   output actually was. */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<time.h>
+#include<unistd.h>
+#include<math.h>
+#include<sys/mman.h>
+#include"midiseq.h"
+#include"rtlog.h"
+
+//number of messages in each ring (power of 2)
+#define RING_SIZE 256
+//of which these are only for note offs
+#define RING_RESERVE 32
+//controllers, then pitchbend and channel pressure of each channel
+#define LATEST_SLOTS (16*128 + 16 + 16)
+#define LATEST_DIRTY (1ULL<<63)
+//controllers and poly aftertouch, then pitchbend and channel pressure of each channel
+#define DEDUP_SLOTS (2*16*128 + 16 + 16)
+#define DEDUP_SET 0x8000
+//output messages waiting for their time (power of 2)
+#define PENDING_SIZE 1024
+//timetags further ahead than this (s) are taken as "now", the pending list
+//isn't meant to hold anything for long
+#define MAX_DELAY 5.0
+
+typedef struct _MidiMessage
+{
+    uint32_t time;
+    uint32_t late;  //frames it was already late when queued
+    int len;	/* Length of MIDI message, in bytes. */
+    uint8_t data[3];
+} MidiMessage;
+
+typedef struct _MIDI_RING
+{
+    uint32_t size;
+    int policy;             //what to do when it's full, MIDI_DROP_NEWEST etc.
+    uint32_t head;          //next slot to write, only written by the producer
+    //counters, only written by the producer
+    unsigned long pushed;
+    unsigned long dropped;
+    unsigned long coalesced;
+    unsigned long noteoffs_lost;
+    uint32_t high_water;
+    //note ons per note that reached the ring or were dropped and still wait
+    //for their note off, a note off is only left out when none reached it
+    uint8_t noteons_queued[16*128];
+    uint8_t noteons_dropped[16*128];
+    char pad[64];           //keep head and tail on separate cache lines
+    uint32_t tail;          //next slot to read, the producer moves it too to drop the oldest
+    int cscan;              //consumer's place in latest[] or -1, see ring_pop_latest
+    char pad2[64];
+    int dirty;              //set by the producer after it wrote to latest[]
+    uint64_t* latest;       //coalesced controller values when the ring was full
+    uint16_t* last_sent;    //the seq's for -dedup, to forget what's dropped
+    MidiMessage ev[];
+} MIDI_RING;
+
+typedef struct _MIDI_PENDING
+{
+    int n;
+    int head;   //where the next one due is, ev[] wraps around
+    MidiMessage ev[PENDING_SIZE];//earliest first, use PENDING_EV()
+    //for -merge
+    uint32_t cycle;     //cycle_start of the last cycle that was merged
+    uint32_t gen;       //bumped every cycle, so seen[] never needs clearing
+    uint32_t seen[LATEST_SLOTS];//gen of the cycle that has a later value
+} MIDI_PENDING;
+
+//the i-th message of the pending list, 0 is the next one due
+#define PENDING_EV(pend,i) ((pend)->ev[((pend)->head+(i)) & (PENDING_SIZE-1)])
+
+//tells apart the sequencers a thread may have queued output to
+static uint32_t seq_serial = 0;
+
+//this thread's ring_out, if it has one
+static __thread MIDI_SEQ* producer_seq = NULL;
+static __thread uint32_t producer_serial = 0;
+static __thread MIDI_RING* producer_ring = NULL;
+
+extern const MIDI_DRIVER jack_driver;
+extern const MIDI_DRIVER loopback_driver;
+
+static const MIDI_DRIVER* midi_drivers[] =
+{
+    &jack_driver,//the default
+    &loopback_driver,
+    NULL
+};
+
+const MIDI_DRIVER* find_midi_driver(const char* name)
+{
+    int i;
+    for(i=0; midi_drivers[i]; i++)
+    {
+        if(!strcmp(name, midi_drivers[i]->name))
+            return midi_drivers[i];
+    }
+    return NULL;
+}
+
+void list_midi_drivers(const char* sep)
+{
+    int i;
+    for(i=0; midi_drivers[i]; i++)
+        printf("%s%s", i ? sep : "", midi_drivers[i]->name);
+}
+
+static MIDI_RING* ring_new(uint32_t size, int policy)
+{
+    MIDI_RING* r = (MIDI_RING*)calloc(1, sizeof(MIDI_RING) + size*sizeof(MidiMessage));
+    r->size = size;
+    r->policy = policy;
+    r->cscan = -1;
+    //don't page fault in the realtime thread
+    mlock(r, sizeof(MIDI_RING) + size*sizeof(MidiMessage));
+    if(policy == MIDI_COALESCE)
+    {
+        r->latest = (uint64_t*)calloc(LATEST_SLOTS, sizeof(uint64_t));
+        mlock(r->latest, LATEST_SLOTS*sizeof(uint64_t));
+    }
+    return r;
+}
+
+static void ring_free(MIDI_RING* r)
+{
+    if(!r)
+        return;
+    if(r->latest)
+    {
+        munlock(r->latest, LATEST_SLOTS*sizeof(uint64_t));
+        free(r->latest);
+    }
+    munlock(r, sizeof(MIDI_RING) + r->size*sizeof(MidiMessage));
+    free(r);
+}
+
+static int is_noteoff(const MidiMessage* ev)
+{
+    return (ev->data[0]&0xF0) == 0x80 || ((ev->data[0]&0xF0) == 0x90 && ev->data[2] == 0);
+}
+
+//data entry and (N)RPN select only mean something in their sequence, and
+//channel mode messages are commands, so none of them is just a position
+//that a later value of the same controller replaces
+static int is_command_cc(const uint8_t data[])
+{
+    return (data[0]&0xF0) == 0xB0 &&
+           (data[1] == 6 || data[1] == 38 || (data[1] >= 96 && data[1] <= 101) || data[1] >= 120);
+}
+
+//where a controller, pitchbend or channel pressure message goes in latest[],
+//-1 for anything else
+static int latest_slot(const uint8_t data[])
+{
+    switch(data[0]&0xF0)
+    {
+    case 0xB0:
+        return (data[0]&0x0F)*128 + data[1];
+    case 0xE0:
+        return 16*128 + (data[0]&0x0F);
+    case 0xD0:
+        return 16*128 + 16 + (data[0]&0x0F);
+    }
+    return -1;
+}
+
+//where a message goes in last_sent[] and the value it is compared by
+//(with DEDUP_SET), -1 for anything that is never a repeat, like notes
+static int dedup_slot(const uint8_t data[], uint16_t* val)
+{
+    int ch = data[0]&0x0F;
+    switch(data[0]&0xF0)
+    {
+    case 0xB0:
+        //repeats of those count
+        if(is_command_cc(data))
+            return -1;
+        *val = DEDUP_SET | data[2];
+        return ch*128 + data[1];
+    case 0xA0:
+        *val = DEDUP_SET | data[2];
+        return 16*128 + ch*128 + data[1];
+    case 0xE0:
+        *val = DEDUP_SET | data[1] | data[2]<<7;
+        return 2*16*128 + ch;
+    case 0xD0:
+        *val = DEDUP_SET | data[1];
+        return 2*16*128 + 16 + ch;
+    }
+    return -1;
+}
+
+//-dedup counted data as sent but it was dropped after all, so the next
+//message with its value isn't a repeat
+static void forget_sent(uint16_t* last_sent, const uint8_t data[])
+{
+    uint16_t val;
+    int k;
+
+    if(last_sent && (k = dedup_slot(data, &val)) >= 0)
+        __atomic_compare_exchange_n(&last_sent[k], &val, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+//the producer side, returns 0 if the message had to be dropped
+static int ring_push(MIDI_RING* r, const MidiMessage* ev)
+{
+    int i;
+    uint32_t head = r->head, tail, used;
+    MidiMessage old;
+    int noteoff = is_noteoff(ev);
+    int noteon = (ev->data[0]&0xF0) == 0x90 && !noteoff;
+    int note = (ev->data[0]&0x0F)*128 + (ev->data[1]&0x7F);
+    //the last few slots are kept for note offs, they must get through
+    uint32_t limit = noteoff ? r->size : r->size - RING_RESERVE;
+
+    if(noteoff)
+    {
+        if(r->noteons_queued[note])
+            r->noteons_queued[note]--;
+        else if(r->noteons_dropped[note])
+        {
+            //no note on of it made it, so this one would only take a reserved slot
+            r->noteons_dropped[note]--;
+            __atomic_store_n(&r->dropped, r->dropped+1, __ATOMIC_RELAXED);
+            return 0;
+        }
+    }
+
+    while((used = head - (tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))) >= limit)
+    {
+        //commands and parts of a sequence can't be replaced by a later
+        //value, they take their chances like notes
+        if(r->policy == MIDI_COALESCE && (i = latest_slot(ev->data)) >= 0 && !is_command_cc(ev->data))
+        {
+            //only the newest value of a controller matters, keep it on the side
+            uint64_t v = ev->time | (uint64_t)(ev->data[1] | ev->data[2]<<7)<<32 | LATEST_DIRTY;
+            __atomic_store_n(&r->latest[i], v, __ATOMIC_RELEASE);
+            __atomic_store_n(&r->dirty, 1, __ATOMIC_RELEASE);
+            __atomic_store_n(&r->coalesced, r->coalesced+1, __ATOMIC_RELAXED);
+            return 1;
+        }
+        if(r->policy != MIDI_DROP_OLDEST || is_noteoff(&r->ev[tail & (r->size-1)]))
+        {
+            if(noteoff)
+                __atomic_store_n(&r->noteoffs_lost, r->noteoffs_lost+1, __ATOMIC_RELAXED);
+            else
+                __atomic_store_n(&r->dropped, r->dropped+1, __ATOMIC_RELAXED);
+            if(noteon && r->noteons_dropped[note] < 255)
+                r->noteons_dropped[note]++;
+            return 0;
+        }
+        //take the oldest away from the consumer, unless it just got it itself
+        old = r->ev[tail & (r->size-1)];
+        if(__atomic_compare_exchange_n(&r->tail, &tail, tail+1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            __atomic_store_n(&r->dropped, r->dropped+1, __ATOMIC_RELAXED);
+            forget_sent(r->last_sent, old.data);
+        }
+    }
+    if(noteon && r->noteons_queued[note] < 255)
+        r->noteons_queued[note]++;
+    //an older coalesced value of this controller must not come out after it
+    if(r->latest && (i = latest_slot(ev->data)) >= 0 && __atomic_load_n(&r->latest[i], __ATOMIC_RELAXED))
+        __atomic_store_n(&r->latest[i], 0, __ATOMIC_RELAXED);
+    r->ev[head & (r->size-1)] = *ev;
+    __atomic_store_n(&r->head, head+1, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->pushed, r->pushed+1, __ATOMIC_RELAXED);
+    if(used+1 > r->high_water)
+        __atomic_store_n(&r->high_water, used+1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+//take the oldest message, returns 0 if the ring is empty
+static int ring_pop(MIDI_RING* r, MidiMessage* ev)
+{
+    uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    do
+    {
+        if(__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail)
+            return 0;
+        *ev = r->ev[tail & (r->size-1)];
+        //if the producer dropped it meanwhile the copy may be torn, try again
+    }
+    while(!__atomic_compare_exchange_n(&r->tail, &tail, tail+1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    return 1;
+}
+
+//take the next coalesced message, after the ring itself is empty since
+//these came in last. Returns 0 if there is none
+static int ring_pop_latest(MIDI_RING* r, MidiMessage* ev)
+{
+    uint64_t v;
+    int i;
+
+    if(!r->latest)
+        return 0;
+    if(r->cscan < 0)
+    {
+        if(!__atomic_exchange_n(&r->dirty, 0, __ATOMIC_ACQ_REL))
+            return 0;
+        r->cscan = 0;
+    }
+    for(i = r->cscan; i < LATEST_SLOTS; i++)
+    {
+        if(!__atomic_load_n(&r->latest[i], __ATOMIC_RELAXED))
+            continue;
+        v = __atomic_exchange_n(&r->latest[i], 0, __ATOMIC_ACQ_REL);
+        if(!(v & LATEST_DIRTY))
+            continue;
+        r->cscan = i+1;
+        ev->time = (uint32_t)v;
+        ev->late = 0;
+        if(i < 16*128)
+        {
+            ev->len = 3;
+            ev->data[0] = 0xB0 | i/128;
+            ev->data[1] = i%128;
+            ev->data[2] = (v>>39)&0x7F;
+        }
+        else if(i < 16*128 + 16)
+        {
+            ev->len = 3;
+            ev->data[0] = 0xE0 | (i - 16*128);
+            ev->data[1] = (v>>32)&0x7F;
+            ev->data[2] = (v>>39)&0x7F;
+        }
+        else
+        {
+            ev->len = 2;
+            ev->data[0] = 0xD0 | (i - 16*128 - 16);
+            ev->data[1] = (v>>32)&0x7F;
+            ev->data[2] = 0;
+        }
+        return 1;
+    }
+    r->cscan = -1;
+    return 0;
+}
+
+static void free_rings(MIDI_SEQ* seq)
+{
+    int i;
+    ring_free(seq->ring_in);
+    for(i=0; i<MIDI_PRODUCERS; i++)
+        ring_free(seq->ring_out[i]);
+    free(seq->pending);
+}
+
+static int ring_empty(MIDI_RING* r)
+{
+    return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)
+           && r->cscan < 0 && !__atomic_load_n(&r->dirty, __ATOMIC_ACQUIRE);
+}
+
+//frame times wrap around, compare them by their difference
+#define FRAME_BEFORE(a,b) ((int32_t)((a)-(b)) < 0)
+
+///////////////////////////////////////////////
+//These functions operate in the driver's RT Thread
+///////////////////////////////////////////////
+
+//messages due at the same time keep the order they were queued in
+//most come in time order and are just appended, only those due before
+//the last one need the later ones moved up
+static void pending_insert(MIDI_PENDING* pend, const MidiMessage* ev)
+{
+    int i = pend->n;
+    while(i > 0 && FRAME_BEFORE(ev->time, PENDING_EV(pend, i-1).time))
+    {
+        PENDING_EV(pend, i) = PENDING_EV(pend, i-1);
+        i--;
+    }
+    PENDING_EV(pend, i) = *ev;
+    pend->n++;
+}
+
+//when the list is full whatever is due last goes, so the ones due soon
+//(and what's due right away) can't be kept out by ones far ahead.
+//Returns 0 if one had to go
+static int pending_add(MIDI_PENDING* pend, const MidiMessage* ev)
+{
+    if(pend->n == PENDING_SIZE)
+    {
+        if(!FRAME_BEFORE(ev->time, PENDING_EV(pend, pend->n-1).time))
+            return 0;
+        pend->n--;
+        pending_insert(pend, ev);
+        return 0;
+    }
+    pending_insert(pend, ev);
+    return 1;
+}
+
+//take the next one due off the list
+static void pending_pop(MIDI_PENDING* pend)
+{
+    pend->head = (pend->head+1) & (PENDING_SIZE-1);
+    pend->n--;
+}
+
+void push_midi_in(MIDI_SEQ* seq, const uint8_t data[], int len, uint32_t time)
+{
+    MidiMessage ev;
+
+    ev.len = len;
+    ev.time = time;
+    ev.late = 0;
+    memcpy(ev.data, data, len);
+    //what doesn't fit is counted, printing is no good in here
+    ring_push(seq->ring_in, &ev);
+}
+
+//wake up the main thread after pushing input, sem_post doesn't block but
+//it's a syscall so only do it when someone is actually waiting
+void notify_midi_in(MIDI_SEQ* seq)
+{
+    if (__atomic_exchange_n(&seq->in_waiting, 0, __ATOMIC_SEQ_CST))
+        sem_post(&seq->in_sem);
+}
+
+//get the next queued message that is due in the cycle starting at frame
+//cycle_start, returns its offset in the cycle or -1 if there is none
+/* With -merge a fader sending faster than the period only gets its last
+   value of each period sent. Once per cycle the messages due in it are
+   looked at latest first, and any controller, pitchbend or channel pressure
+   that has a later one of its own in the same cycle is marked with len 0 so
+   pop_midi_out() skips it. Everything else is left alone, and so are the
+   controllers of is_command_cc(). */
+static void merge_cycle(MIDI_SEQ* seq, uint32_t nframes, uint32_t cycle_start)
+{
+    int i, k;
+    MIDI_PENDING* pend = seq->pending;
+
+    pend->cycle = cycle_start;
+    if(!++pend->gen)
+        pend->gen = 1;//0 is what seen[] starts with
+
+    //the ones due this cycle are at the front, look at them latest first
+    for(i=0; i<pend->n; i++)
+        if((int)(PENDING_EV(pend, i).time + nframes - cycle_start) >= (int)nframes)
+            break;
+    while(i-- > 0)
+    {
+        MidiMessage* ev = &PENDING_EV(pend, i);
+        if((k = latest_slot(ev->data)) < 0 || is_command_cc(ev->data))
+            continue;
+        if(pend->seen[k] == pend->gen)
+            ev->len = 0;
+        else
+            pend->seen[k] = pend->gen;
+    }
+}
+
+int pop_midi_out(MIDI_SEQ* seq, uint32_t nframes, uint32_t cycle_start, uint8_t data[], int* len)
+{
+    int i, n, t, soon;
+    uint32_t late;
+    MidiMessage ev;
+    MIDI_RING* r;
+    MIDI_PENDING* pend = seq->pending;
+
+    n = __atomic_load_n(&seq->nproducers, __ATOMIC_ACQUIRE);
+    if(n > MIDI_PRODUCERS)
+        n = MIDI_PRODUCERS;
+    soon = seq->latency + nframes + seq->drv->sample_rate(seq)/10;
+    for(i=0; i<n; i++)
+    {
+        //the slot is taken before the ring is there
+        if(!(r = __atomic_load_n(&seq->ring_out[i], __ATOMIC_ACQUIRE)))
+            continue;
+        //once the list is full of what's due soon (-dejitter and a driver
+        //running behind put even immediate messages a bit ahead) the rest
+        //waits in the rings, otherwise something due later makes room
+        while((pend->n < PENDING_SIZE ||
+                (int)(PENDING_EV(pend, pend->n-1).time - cycle_start) > soon) &&
+                (ring_pop(r, &ev) || ring_pop_latest(r, &ev)))
+        {
+            if(!pending_add(pend, &ev))
+                __atomic_store_n(&seq->pending_dropped, seq->pending_dropped+1, __ATOMIC_RELAXED);
+        }
+    }
+    if(!pend->n)
+        return -1;
+    if(seq->merge && (pend->cycle != cycle_start || !pend->gen))
+        merge_cycle(seq, nframes, cycle_start);
+
+    for(;;)
+    {
+        ev = PENDING_EV(pend, 0);
+        t = ev.time + nframes - cycle_start;
+
+        /* If computed time is too much into the future, we'll need
+           to send it later. */
+        if (t >= (int)nframes)
+            return -1;
+        if(ev.len)
+            break;
+        //merged into a later one
+        pending_pop(pend);
+        __atomic_store_n(&seq->merged, seq->merged+1, __ATOMIC_RELAXED);
+        if(!pend->n)
+            return -1;
+    }
+
+    /* If computed time is < 0, we missed a cycle because of xrun. */
+    late = ev.late;
+    if (t < 0)
+    {
+        late -= t;
+        t = 0;
+    }
+
+    if(!seq->timing.n || late < seq->timing.min)
+        seq->timing.min = late;
+    if(late > seq->timing.max)
+        seq->timing.max = late;
+    __atomic_store_n(&seq->timing.n, seq->timing.n+1, __ATOMIC_RELAXED);
+    seq->timing.sum += late;
+    seq->timing.sum2 += (double)late*late;
+
+    pending_pop(pend);
+    memcpy(data, ev.data, ev.len);
+    *len = ev.len;
+    return t;
+}
+
+/* The drivers time their cycles with these: begin_midi_cycle() at the top,
+   end_midi_stage() after each of input, filter and output, end_midi_cycle()
+   at the bottom. That's one clock_gettime() and a few atomic adds per
+   stage, cheap enough to be always on. The sum of
+   total over the sum of period is the share of the driver's time (for JACK
+   the DSP load) that is osc2midi's. */
+
+//will warn if the time between two cycles is longer than this (ns)
+#define MAX_TIME_BETWEEN_CYCLES 100000000
+//or if a cycle takes longer than this
+#define MAX_PROCESSING_TIME 10000000
+
+//returns the start of the cycle for the other two
+uint64_t begin_midi_cycle(MIDI_SEQ* seq)
+{
+    uint64_t now = stats_now();
+    MIDI_CYCLES* c = &seq->cycles;
+
+    if(c->last)
+    {
+        stats_add(&c->period, now - c->last);
+        if(now - c->last > MAX_TIME_BETWEEN_CYCLES)
+            rtlog("Had to wait %ld us for the midi driver's cycle; scheduling problem?",
+                  (long)(now - c->last)/1000, 0);
+    }
+    c->last = now;
+    return now;
+}
+
+//returns the end of the stage, which is the start of the next one
+uint64_t end_midi_stage(STATS_HIST* stage, uint64_t start)
+{
+    uint64_t now = stats_now();
+    stats_add(stage, now - start);
+    return now;
+}
+
+//end is what the last end_midi_stage() returned
+void end_midi_cycle(MIDI_SEQ* seq, uint64_t start, uint64_t end, int events)
+{
+    uint64_t t = end - start;
+
+    stats_add(&seq->cycles.total, t);
+    stats_add(&seq->cycles.events, events);
+    if(t > MAX_PROCESSING_TIME)
+        rtlog("Processing took %ld us; scheduling problem?", (long)t/1000, 0);
+}
+
+///////////////////////////////////////////////
+//these functions are executed in other threads
+///////////////////////////////////////////////
+
+//the calling thread's ring_out, made the first time it asks
+static MIDI_RING* get_producer_ring(MIDI_SEQ* seq)
+{
+    int i;
+
+    if(producer_seq == seq && producer_serial == seq->serial)
+        return producer_ring;
+
+    producer_seq = seq;
+    producer_serial = seq->serial;
+    producer_ring = NULL;
+    i = __atomic_fetch_add(&seq->nproducers, 1, __ATOMIC_RELAXED);
+    if(i >= MIDI_PRODUCERS)
+    {
+        printf("Too many threads queueing midi, their MIDI is LOST.\n");
+        return NULL;
+    }
+    producer_ring = ring_new(RING_SIZE, seq->overflow);
+    producer_ring->last_sent = seq->last_sent;
+    __atomic_store_n(&seq->ring_out[i], producer_ring, __ATOMIC_RELEASE);
+    return producer_ring;
+}
+void queue_midi(MIDI_SEQ* seqq, uint8_t msg[])
+{
+    queue_midi_at(seqq, msg, 0);
+}
+
+//queue a message to go out delay seconds from now
+void queue_midi_at(MIDI_SEQ* seqq, uint8_t msg[], double delay)
+{
+    MidiMessage ev;
+    MIDI_RING* r;
+    double due;
+    int k = -1;
+    uint16_t val = 0;
+    ev.len = 3;
+
+    // At least with JackOSX, Jack will transmit the bytes verbatim, so make
+    // sure that we look at the status byte and trim the message accordingly,
+    // in order not to transmit any invalid MIDI data.
+    switch (msg[0] & 0xf0)
+    {
+    case 0x80:
+    case 0x90:
+    case 0xa0:
+    case 0xb0:
+    case 0xe0:
+        break; // 2 data bytes
+    case 0xc0:
+    case 0xd0:
+        ev.len = 2; // 1 data byte
+        break;
+    case 0xf0: // system message
+        switch (msg[0])
+        {
+        case 0xf2:
+            break; // 2 data bytes
+        case 0xf1:
+        case 0xf3:
+            ev.len = 2; // 1 data byte
+            break;
+        case 0xf6:
+        case 0xf8:
+        case 0xf9:
+        case 0xfa:
+        case 0xfb:
+        case 0xfc:
+        case 0xfe:
+        case 0xff:
+            ev.len = 1; // no data byte
+            break;
+        default:
+            // ignore unknown (most likely sysex)
+            return;
+        }
+        break;
+    default:
+        return; // not a valid MIDI message, bail out
+    }
+
+    ev.data[0] = msg[0];
+    ev.data[1] = msg[1];
+    ev.data[2] = msg[2];
+
+    //a fader moving less than a step of the midi value gives the same
+    //message again, which changes nothing on the other end
+    if(seqq->last_sent && (k = dedup_slot(ev.data, &val)) >= 0 &&
+            __atomic_exchange_n(&seqq->last_sent[k], val, __ATOMIC_RELAXED) == val)
+    {
+        __atomic_fetch_add(&seqq->dedup_hits, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    //in frames from now, kept well inside of what the frame clock can tell apart
+    due = seqq->latency;
+    if(delay && delay < MAX_DELAY)
+        due += delay*seqq->drv->sample_rate(seqq);
+    if(due > 1e9)
+        due = 1e9;
+    //anything late goes out right away
+    ev.late = 0;
+    if(due < 0)
+    {
+        ev.late = due < -1e9 ? 1e9 : -due;
+        due = 0;
+    }
+    ev.time = seqq->drv->frame_time(seqq) + (uint32_t)due;
+    if((r = get_producer_ring(seqq)) && ring_push(r, &ev))
+        return;
+    //it never went out, so the next one with this value isn't a repeat
+    if(k >= 0)
+        forget_sent(seqq->last_sent, ev.data);
+}
+
+int pop_midi(MIDI_SEQ* seqq, uint8_t msg[])
+{
+    MidiMessage ev;
+
+    if(!ring_pop(seqq->ring_in, &ev) && !ring_pop_latest(seqq->ring_in, &ev))
+        return 0;
+    memcpy(msg,ev.data,ev.len);
+    return ev.len;
+}
+
+//block until there is midi input to pop or the timeout runs out
+//returns 1 if there is input
+int wait_midi(MIDI_SEQ* seqq, int timeout_ms)
+{
+    struct timespec ts;
+
+    if (!seqq->usein)
+    {
+        usleep(timeout_ms*1000);
+        return 0;
+    }
+
+    //say we're waiting before looking at the ring, so anything the driver
+    //queues after we looked will post the semaphore
+    __atomic_store_n(&seqq->in_waiting, 1, __ATOMIC_SEQ_CST);
+    if (!ring_empty(seqq->ring_in))
+    {
+        __atomic_store_n(&seqq->in_waiting, 0, __ATOMIC_SEQ_CST);
+        return 1;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout_ms/1000;
+    ts.tv_nsec += (timeout_ms%1000)*1000000;
+    if (ts.tv_nsec >= 1000000000)
+    {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    //a stale post from an earlier wake up or a signal just makes us return
+    //early, the caller looks again anyway
+    sem_timedwait(&seqq->in_sem, &ts);
+    __atomic_store_n(&seqq->in_waiting, 0, __ATOMIC_SEQ_CST);
+    return !ring_empty(seqq->ring_in);
+}
+
+////////////////////////////////
+//this is run in the main thread
+////////////////////////////////
+
+//the counters of ring 0 (input) or the output ring of the ring-1th thread
+//that queued midi, returns 0 if there is no such ring
+int get_midi_ring_stats(MIDI_SEQ* seq, int ring, MIDI_RING_STATS* st)
+{
+    MIDI_RING* r;
+
+    if(ring < 0 || ring > MIDI_PRODUCERS)
+        return 0;
+    r = ring ? __atomic_load_n(&seq->ring_out[ring-1], __ATOMIC_ACQUIRE) : seq->ring_in;
+    if(!r)
+        return 0;
+    st->size = r->size;
+    st->pushed = __atomic_load_n(&r->pushed, __ATOMIC_RELAXED);
+    st->dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    st->coalesced = __atomic_load_n(&r->coalesced, __ATOMIC_RELAXED);
+    st->noteoffs_lost = __atomic_load_n(&r->noteoffs_lost, __ATOMIC_RELAXED);
+    st->high_water = __atomic_load_n(&r->high_water, __ATOMIC_RELAXED);
+    st->occupancy = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    return 1;
+}
+
+//all of them if verbose, else just those that lost something
+void print_midi_rings(MIDI_SEQ* seq, uint8_t verbose)
+{
+    int i;
+    MIDI_RING_STATS st;
+
+    for(i=0; i<=MIDI_PRODUCERS; i++)
+    {
+        if(!get_midi_ring_stats(seq, i, &st))
+            continue;
+        if(!verbose && !st.dropped && !st.noteoffs_lost)
+            continue;
+        if(i)
+            printf(" midi out queue %i:", i-1);
+        else
+            printf(" midi in queue:");
+        printf(" %lu queued, %lu dropped, %lu coalesced, %lu note offs lost, high water %u/%u\n",
+               st.pushed, st.dropped, st.coalesced, st.noteoffs_lost, st.high_water, st.size);
+    }
+    if(seq->dedup)
+        printf(" %lu repeated midi values not queued\n",
+               __atomic_load_n(&seq->dedup_hits, __ATOMIC_RELAXED));
+    if(verbose || seq->pending_dropped)
+        printf(" %lu timed midi messages dropped, too many were waiting\n",
+               __atomic_load_n(&seq->pending_dropped, __ATOMIC_RELAXED));
+}
+
+void print_midi_timing(MIDI_SEQ* seq)
+{
+    MIDI_TIMING* tm = &seq->timing;
+    double mean, var;
+
+    if(!tm->n)
+        return;
+    mean = tm->sum/tm->n;
+    var = tm->sum2/tm->n - mean*mean;
+    printf(" %lu midi messages out, late by min %u max %u mean %.1f stddev %.1f frames\n",
+           tm->n, tm->min, tm->max, mean, var > 0 ? sqrt(var) : 0);
+    if(seq->merge)
+        printf(" %lu controller values merged into a later one in the same period\n",
+               __atomic_load_n(&seq->merged, __ATOMIC_RELAXED));
+}
+
+static void print_cycle_hist(const char* name, const STATS_HIST* h, double unit, const char* units)
+{
+    STATS_HIST c;
+
+    stats_read(h, &c);
+    if(!c.n)
+        return;
+    printf("   %-7s mean %.1f median %.1f 99%% %.1f max %.1f%s\n", name,
+           c.sum/unit/c.n, stats_percentile(&c, .5)/unit, stats_percentile(&c, .99)/unit,
+           c.max/unit, units);
+}
+
+void print_midi_cycles(MIDI_SEQ* seq)
+{
+    MIDI_CYCLES* c = &seq->cycles;
+    STATS_HIST total, period;
+
+    stats_read(&c->total, &total);
+    stats_read(&c->period, &period);
+    if(!total.n)
+        return;
+    printf(" %lu midi driver cycles, osc2midi used %.3f%% of the time\n", total.n,
+           period.sum ? 100.0*total.sum/period.sum : 0);
+    print_cycle_hist("period", &c->period, 1000, " us");
+    print_cycle_hist("input", &c->in, 1000, " us");
+    print_cycle_hist("filter", &c->filter, 1000, " us");
+    print_cycle_hist("output", &c->out, 1000, " us");
+    print_cycle_hist("total", &c->total, 1000, " us");
+    print_cycle_hist("events", &c->events, 1, "");
+}
+
+int init_midi_seq(MIDI_SEQ* seq, uint8_t verbose, const char* clientname)
+{
+    if(!seq->drv)
+        seq->drv = midi_drivers[0];
+    seq->nnotes = 0;
+    seq->old_filter = 0;
+    seq->ring_in = seq->usein ? ring_new(RING_SIZE, seq->overflow) : NULL;
+    memset(seq->ring_out, 0, sizeof(seq->ring_out));
+    seq->nproducers = 0;
+    seq->serial = ++seq_serial;
+    memset(&seq->timing, 0, sizeof(MIDI_TIMING));
+    seq->merged = 0;
+    seq->pending_dropped = 0;
+    memset(&seq->cycles, 0, sizeof(MIDI_CYCLES));
+    seq->dedup_hits = 0;
+    seq->last_sent = seq->dedup && seq->useout ? (uint16_t*)calloc(DEDUP_SLOTS, sizeof(uint16_t)) : NULL;
+    seq->pending = NULL;
+    if(seq->useout)
+    {
+        seq->pending = (MIDI_PENDING*)calloc(1, sizeof(MIDI_PENDING));
+        mlock(seq->pending, sizeof(MIDI_PENDING));
+    }
+    seq->in_waiting = 0;
+    sem_init(&seq->in_sem, 0, 0);
+
+    if(verbose)printf("using %s midi driver...\n", seq->drv->name);
+    if(!seq->drv->open(seq, verbose, clientname))
+    {
+        free_rings(seq);
+        free(seq->last_sent);
+        sem_destroy(&seq->in_sem);
+        return 0;
+    }
+    return 1;
+}
+
+void close_midi_seq(MIDI_SEQ* seq)
+{
+    //stops the driver's thread, so nothing touches the rings after this
+    seq->drv->close(seq);
+    free_rings(seq);
+    free(seq->last_sent);
+    seq->last_sent = NULL;
+    sem_destroy(&seq->in_sem);
+}
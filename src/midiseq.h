@@ -2,11 +2,61 @@
 #define MIDI_SEQ_H
 #include<stdint.h>
 #include<stdbool.h>
+#include<semaphore.h>
+#include"stats.h"
+
+struct _MIDI_DRIVER;
+struct _MIDI_RING;
+struct _MIDI_PENDING;
+
+//most threads that can queue midi output at the same time
+#define MIDI_PRODUCERS 16
+
+//what to do with midi when a queue is full, note offs are never dropped
+//(unless even the slots kept for them are full)
+#define MIDI_DROP_NEWEST 0
+#define MIDI_DROP_OLDEST 1
+#define MIDI_COALESCE 2 //keep only the newest value of controllers, pitchbend
+                        //and channel pressure, else drop the newest
+
+typedef struct _MIDI_RING_STATS
+{
+    uint32_t size;
+    uint32_t occupancy;
+    uint32_t high_water;
+    unsigned long pushed;
+    unsigned long dropped;
+    unsigned long coalesced;
+    unsigned long noteoffs_lost;
+} MIDI_RING_STATS;
+
+//how late the output went out compared to when it was due, in frames
+typedef struct _MIDI_TIMING
+{
+    unsigned long n;
+    uint32_t min;
+    uint32_t max;
+    double sum;
+    double sum2;
+} MIDI_TIMING;
+
+//what the driver's cycles cost, written by its thread only (times in ns)
+typedef struct _MIDI_CYCLES
+{
+    STATS_HIST period;  //from the start of one cycle to the start of the next
+    STATS_HIST in;      //each stage of a cycle
+    STATS_HIST filter;
+    STATS_HIST out;
+    STATS_HIST total;   //the whole cycle
+    STATS_HIST events;  //midi events handled in a cycle, a count, not ns
+    uint64_t last;      //when the last cycle started
+} MIDI_CYCLES;
 
 //general midi sequencer data
 typedef struct _mseq
 {
-    void* driver;
+    const struct _MIDI_DRIVER* drv;//backend, jack unless set otherwise
+    void* driver;                  //backend data
     bool usein;
     bool useout;
     bool usefilter;
@@ -17,11 +67,59 @@ typedef struct _mseq
     uint8_t note[127];
     uint8_t notevel[127];
     uint8_t nnotes;
+
+    //queues between the driver's thread and the rest of the program
+    struct _MIDI_RING* ring_in;
+    struct _MIDI_RING* ring_out[MIDI_PRODUCERS];//one per thread calling queue_midi
+    int nproducers;
+    uint32_t serial;
+    struct _MIDI_PENDING* pending;//output taken off the ring_outs, sorted by time
+    uint32_t latency;    //frames added to every output message (-dejitter)
+    int overflow;        //MIDI_DROP_NEWEST etc.
+    bool merge;          //send only the last value of a controller in a period (-merge)
+    bool dedup;          //don't queue a controller value that is already set (-dedup)
+    uint16_t* last_sent; //last value queued for each controller etc., for dedup
+    unsigned long dedup_hits;//repeats that weren't queued
+    MIDI_TIMING timing;  //only written by the driver thread
+    unsigned long merged;//controller values dropped by -merge, same
+    unsigned long pending_dropped;//timed ones that didn't fit in pending, same
+    MIDI_CYCLES cycles;  //only written by the driver thread
+    bool print_cycles;   //print them when quitting (-cycles)
+    sem_t in_sem;   //posted by the driver thread when it queued input...
+    int in_waiting; //...but only if the main thread is waiting for it
 } MIDI_SEQ;
 
+//a midi backend, the driver runs its own (realtime) thread which moves the
+//messages between the rings and the outside world
+typedef struct _MIDI_DRIVER
+{
+    const char* name;
+    int (*open)(MIDI_SEQ* seq, uint8_t verbose, const char* clientname);//returns 1 on success
+    void (*close)(MIDI_SEQ* seq);
+    uint32_t (*frame_time)(MIDI_SEQ* seq);//current time in frames, used to schedule output
+    uint32_t (*sample_rate)(MIDI_SEQ* seq);
+} MIDI_DRIVER;
+
+const MIDI_DRIVER* find_midi_driver(const char* name);
+void list_midi_drivers(const char* sep);
+
 int init_midi_seq(MIDI_SEQ* seq, uint8_t verbose, const char* clientname);
 void close_midi_seq(MIDI_SEQ* seq);
 void queue_midi(MIDI_SEQ* seqq, uint8_t msg[]);
+void queue_midi_at(MIDI_SEQ* seqq, uint8_t msg[], double delay);
 int pop_midi(MIDI_SEQ* seqq, uint8_t msg[]);
+int wait_midi(MIDI_SEQ* seqq, int timeout_ms);
+void print_midi_timing(MIDI_SEQ* seqq);
+void print_midi_cycles(MIDI_SEQ* seq);
+int get_midi_ring_stats(MIDI_SEQ* seq, int ring, MIDI_RING_STATS* st);
+void print_midi_rings(MIDI_SEQ* seq, uint8_t verbose);
+
+//these are for the drivers and run in their thread
+void push_midi_in(MIDI_SEQ* seq, const uint8_t data[], int len, uint32_t time);
+void notify_midi_in(MIDI_SEQ* seq);
+int pop_midi_out(MIDI_SEQ* seq, uint32_t nframes, uint32_t cycle_start, uint8_t data[], int* len);
+uint64_t begin_midi_cycle(MIDI_SEQ* seq);
+uint64_t end_midi_stage(STATS_HIST* stage, uint64_t start);
+void end_midi_cycle(MIDI_SEQ* seq, uint64_t start, uint64_t end, int events);
 
 #endif
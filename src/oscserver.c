@@ -3,13 +3,22 @@
 //modified from the example code from the liblo documentation
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <netdb.h>
 
 #include "lo/lo.h"
 #include "pair.h"
 #include "oscserver.h"
 #include "converter.h"
 #include "midiseq.h"
+#include "trace.h"
 
 int done = 0;
 
@@ -21,6 +30,79 @@ int msg_handler(const char *path, const char *types, lo_arg ** argv,
                 int argc, void *data, void *user_data);
 
 
+/* What a rule's '@ rate' leaves out is held by the rule (only the newest)
+   and this thread sends it once the interval is over, so a fader that stops
+   in the middle of one still ends up where it stopped. It sleeps until the
+   next held message is due, or until a handler posts held_sem because a
+   rule started to hold something. */
+static pthread_t held_thread;
+static sem_t held_sem;
+static int held_running = 0;
+static int held_done = 0;
+
+static void* send_held(void* arg)
+{
+    CONVERTER* conv = (CONVERTER*)arg;
+    PAIRSET* map;
+    uint8_t midi[3];
+    uint32_t wait;
+    struct timespec ts;
+    int j;
+
+    while(!__atomic_load_n(&held_done, __ATOMIC_RELAXED))
+    {
+        wait = UINT32_MAX;
+        map = map_enter(conv);
+        for(j=0; j<map->npairs; j++)
+        {
+            if(take_pair_held(map->p[j], midi, &wait))
+                queue_midi_at(&conv->seq, midi, 0);
+        }
+        map_exit(conv);
+        if(wait == UINT32_MAX)
+        {
+            sem_wait(&held_sem);
+            continue;
+        }
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += wait/1000;
+        ts.tv_nsec += (wait%1000)*1000000;
+        if(ts.tv_nsec >= 1000000000)
+        {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        sem_timedwait(&held_sem, &ts);
+    }
+    return NULL;
+}
+
+static void start_held(CONVERTER* data)
+{
+    if(data->mon_mode || held_running)
+        return;
+    sem_init(&held_sem, 0, 0);
+    held_done = 0;
+    if(pthread_create(&held_thread, NULL, send_held, data))
+    {
+        printf("can't start the thread for held messages, '@' drops them\n");
+        sem_destroy(&held_sem);
+        return;
+    }
+    __atomic_store_n(&held_running, 1, __ATOMIC_RELEASE);
+}
+
+static void stop_held(void)
+{
+    if(!held_running)
+        return;
+    __atomic_store_n(&held_done, 1, __ATOMIC_RELAXED);
+    sem_post(&held_sem);
+    pthread_join(held_thread, NULL);
+    sem_destroy(&held_sem);
+    held_running = 0;
+}
+
 lo_server_thread start_osc_server(char* port, CONVERTER* data)
 {
     /* start a new server on port 7770 */
@@ -32,7 +114,13 @@ lo_server_thread start_osc_server(char* port, CONVERTER* data)
     else
         lo_server_thread_add_method(st, NULL, NULL, msg_handler, data);
 
+    //we want bundles as soon as they arrive, their timetag is used to
+    //schedule the midi rather than to hold back the whole message
+    if(!data->mon_mode)
+        lo_server_enable_queue(lo_server_thread_get_server(st), 0, 1);
+
     lo_server_thread_start(st);
+    start_held(data);
     printf("starting osc server on port %s\n",port);
     return st;
 }
@@ -41,10 +129,160 @@ lo_server_thread start_osc_server(char* port, CONVERTER* data)
 int stop_osc_server(lo_server_thread st)
 {
     lo_server_thread_free(st);
+    stop_held();
 
     return 0;
 }
 
+/* With -workers the port is opened several times with SO_REUSEPORT and the
+   kernel spreads the incoming datagrams over the sockets (by sender, so one
+   client always lands on the same worker). Each worker has a thread that
+   reads its socket and hands the data to a private lo_server for parsing and
+   dispatch, so all the matching runs in parallel. The workers share the map
+   and each gets its own midi output queue the first time it queues midi.
+   Since liblo never sees where the data came from, the worker keeps the
+   sender of the datagram being dispatched for replies (see reply_address). */
+typedef struct _OSC_WORKER
+{
+    pthread_t thread;
+    int sock;               //srv's own socket, see start_osc_workers()
+    lo_server srv;          //just parses and dispatches what sock receives
+    unsigned long ndatagrams;
+    struct sockaddr_storage from;//sender of the datagram being dispatched
+    socklen_t fromlen;
+    lo_address reply;       //made from it when a handler wants to answer
+} OSC_WORKER;
+
+static OSC_WORKER* workers = NULL;
+static int nworkers = 0;
+static int workers_done = 0;
+//the worker of the calling thread, if it is one
+static __thread OSC_WORKER* this_worker = NULL;
+
+static void* osc_worker(void* arg)
+{
+    OSC_WORKER* w = (OSC_WORKER*)arg;
+    char buf[65536];
+    ssize_t n;
+
+    this_worker = w;
+    while(!__atomic_load_n(&workers_done, __ATOMIC_RELAXED))
+    {
+        //times out now and then to see if we're done
+        w->fromlen = sizeof(w->from);
+        n = recvfrom(w->sock, buf, sizeof(buf), 0, (struct sockaddr*)&w->from, &w->fromlen);
+        if(n > 0)
+        {
+            lo_server_dispatch_data(w->srv, buf, n);
+            w->ndatagrams++;
+        }
+    }
+    return NULL;
+}
+
+static int open_worker_socket(char* port)
+{
+    int sock, one = 1;
+    struct timeval tv = {0, 100000};
+    struct addrinfo hints, *ai;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+    if(getaddrinfo(NULL, port, &hints, &ai))
+    {
+        printf("can't use port %s\n", port);
+        return -1;
+    }
+    sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if(sock < 0 ||
+            setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) ||
+            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) ||
+            bind(sock, ai->ai_addr, ai->ai_addrlen))
+    {
+        perror("osc worker socket");
+        if(sock >= 0)
+            close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(ai);
+    return sock;
+}
+
+int start_osc_workers(char* port, CONVERTER* data)
+{
+    int sock;
+
+    workers = (OSC_WORKER*)calloc(data->workers, sizeof(OSC_WORKER));
+    workers_done = 0;
+    for(nworkers=0; nworkers<data->workers; nworkers++)
+    {
+        OSC_WORKER* w = &workers[nworkers];
+        //liblo can't be handed a socket, and lo_server_new() opens one of its
+        //own on some free port. That one is replaced by the SO_REUSEPORT one
+        //under the same descriptor, so no other port is left open and
+        //lo_server_free() closes ours
+        if(!(w->srv = lo_server_new(NULL, error)))
+            break;
+        w->sock = lo_server_get_socket_fd(w->srv);
+        if(w->sock < 0 || (sock = open_worker_socket(port)) < 0)
+        {
+            lo_server_free(w->srv);
+            break;
+        }
+        if(dup2(sock, w->sock) < 0)
+        {
+            perror("osc worker socket");
+            close(sock);
+            lo_server_free(w->srv);
+            break;
+        }
+        close(sock);
+        if(data->mon_mode)
+            lo_server_add_method(w->srv, NULL, NULL, mon_handler, NULL);
+        else
+        {
+            lo_server_add_method(w->srv, NULL, NULL, msg_handler, data);
+            lo_server_enable_queue(w->srv, 0, 1);
+        }
+        if(pthread_create(&w->thread, NULL, osc_worker, w))
+        {
+            lo_server_free(w->srv);
+            break;
+        }
+    }
+    if(nworkers < data->workers)
+    {
+        printf("could only start %i of %i osc workers\n", nworkers, data->workers);
+        stop_osc_workers(0);
+        return 0;
+    }
+    start_held(data);
+    printf("starting %i osc workers on port %s\n", nworkers, port);
+    return 1;
+}
+
+void stop_osc_workers(uint8_t verbose)
+{
+    int i;
+
+    __atomic_store_n(&workers_done, 1, __ATOMIC_RELAXED);
+    for(i=0; i<nworkers; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        if(verbose)
+            printf(" osc worker %i: %lu datagrams\n", i, workers[i].ndatagrams);
+        lo_server_free(workers[i].srv);
+        if(workers[i].reply)
+            lo_address_free(workers[i].reply);
+    }
+    free(workers);
+    workers = NULL;
+    nworkers = 0;
+    stop_held();
+}
+
 void error(int num, const char *msg, const char *path)
 {
     printf("liblo server error %d in path %s: %s\n", num, path, msg);
@@ -55,22 +293,160 @@ void error(int num, const char *msg, const char *path)
  * message has not been fully handled and the server should try other methods */
 int mon_handler(const char *path, const char *types, lo_arg ** argv,
                 int argc, void *data, void *user_data)
+{
+    //printed by the trace thread
+    trace_osc(TRACE_MON, 0, path, types, argv, argc, NULL, 0, -1);
+    return 0;
+}
+
+//unit is what the values are divided by, 1000 for ns to us
+static void send_hist(lo_address addr, const char* path, const STATS_HIST* h, double unit)
+{
+    STATS_HIST c;
+    lo_message m = lo_message_new();
+
+    stats_read(h, &c);
+    //count, then mean, median, 99th percentile and max
+    lo_message_add_int64(m, c.n);
+    lo_message_add_float(m, c.n ? c.sum/unit/c.n : 0);
+    lo_message_add_float(m, stats_percentile(&c, .5)/unit);
+    lo_message_add_float(m, stats_percentile(&c, .99)/unit);
+    lo_message_add_float(m, c.max/unit);
+    lo_send_message(addr, path, m);
+    lo_message_free(m);
+}
+
+//reply to /osc2midi/stats with one message for each group of counters
+static void send_stats(lo_address addr, CONVERTER* conv)
 {
     int i;
+    char name[20];
+    lo_message m;
+    MIDI_RING_STATS st;
+    STATS_HIST h, p;
+    STATS* s = &conv->stats;
+    MIDI_CYCLES* cyc = &conv->seq.cycles;
+    PAIRSET* map;
 
-    printf("%s ", path);
-    for (i = 0; i < argc; i++)
+    //messages in and the rules tried for them
+    stats_read(&s->osc_time, &h);
+    m = lo_message_new();
+    lo_message_add_int64(m, h.n);
+    lo_message_add_int64(m, __atomic_load_n(&s->osc_tries, __ATOMIC_RELAXED));
+    lo_send_message(addr, "/osc2midi/stats/osc", m);
+    lo_message_free(m);
+
+    stats_read(&s->midi_time, &h);
+    m = lo_message_new();
+    lo_message_add_int64(m, h.n);
+    lo_message_add_int64(m, __atomic_load_n(&s->midi_tries, __ATOMIC_RELAXED));
+    lo_send_message(addr, "/osc2midi/stats/midi", m);
+    lo_message_free(m);
+
+    m = lo_message_new();
+    lo_message_add_int64(m, __atomic_load_n(&conv->seq.timing.n, __ATOMIC_RELAXED));
+    lo_message_add_int64(m, __atomic_load_n(&conv->seq.merged, __ATOMIC_RELAXED));
+    lo_message_add_int64(m, __atomic_load_n(&conv->seq.dedup_hits, __ATOMIC_RELAXED));
+    lo_send_message(addr, "/osc2midi/stats/midi_out", m);
+    lo_message_free(m);
+
+    send_hist(addr, "/osc2midi/stats/osc_time", &s->osc_time, 1000);
+    send_hist(addr, "/osc2midi/stats/midi_time", &s->midi_time, 1000);
+    send_hist(addr, "/osc2midi/stats/cycle_time", &cyc->total, 1000);
+    send_hist(addr, "/osc2midi/stats/cycle_period", &cyc->period, 1000);
+    send_hist(addr, "/osc2midi/stats/cycle_in", &cyc->in, 1000);
+    send_hist(addr, "/osc2midi/stats/cycle_filter", &cyc->filter, 1000);
+    send_hist(addr, "/osc2midi/stats/cycle_out", &cyc->out, 1000);
+    send_hist(addr, "/osc2midi/stats/cycle_events", &cyc->events, 1);
+
+    //share of the driver's time spent in its cycles, in percent
+    stats_read(&cyc->total, &h);
+    stats_read(&cyc->period, &p);
+    m = lo_message_new();
+    lo_message_add_float(m, p.sum ? 100.0*h.sum/p.sum : 0);
+    lo_send_message(addr, "/osc2midi/stats/load", m);
+    lo_message_free(m);
+
+    for(i=0; i<=MIDI_PRODUCERS; i++)
     {
-        printf("%c", types[i]);
+        if(!get_midi_ring_stats(&conv->seq, i, &st))
+            continue;
+        if(i)
+            sprintf(name, "out%i", i-1);
+        else
+            strcpy(name, "in");
+        m = lo_message_new();
+        lo_message_add_string(m, name);
+        lo_message_add_int32(m, st.size);
+        lo_message_add_int32(m, st.occupancy);
+        lo_message_add_int32(m, st.high_water);
+        lo_message_add_int64(m, st.pushed);
+        lo_message_add_int64(m, st.dropped);
+        lo_message_add_int64(m, st.coalesced);
+        lo_message_add_int64(m, st.noteoffs_lost);
+        lo_send_message(addr, "/osc2midi/stats/ring", m);
+        lo_message_free(m);
     }
-    for (i = 0; i < argc; i++)
+
+    //only the rules that matched something, by their place in the map
+    //(counted since the map was last loaded)
+    map = map_enter(conv);
+    for(i=0; i<map->npairs; i++)
     {
-        printf(", ");
-        lo_arg_pp((lo_type)types[i], argv[i]);
+        unsigned long o = __atomic_load_n(&map->osc_hits[i], __ATOMIC_RELAXED);
+        unsigned long mi = __atomic_load_n(&map->midi_hits[i], __ATOMIC_RELAXED);
+        unsigned long th = __atomic_load_n(&map->throttled[i], __ATOMIC_RELAXED);
+        if(!o && !mi && !th)
+            continue;
+        m = lo_message_new();
+        lo_message_add_int32(m, i);
+        lo_message_add_int64(m, o);
+        lo_message_add_int64(m, mi);
+        lo_message_add_int64(m, th);
+        lo_send_message(addr, "/osc2midi/stats/pair", m);
+        lo_message_free(m);
     }
-    printf("\n\n");
-    fflush(stdout);
+    map_exit(conv);
+}
+
+//where to answer msg, NULL if that isn't known
+static lo_address reply_address(lo_message msg)
+{
+    char host[NI_MAXHOST], port[NI_MAXSERV];
+    OSC_WORKER* w = this_worker;
+
+    if(!w)
+        return lo_message_get_source(msg);
+    //what the worker's recvfrom() got, liblo only knows its own socket's
+    if(getnameinfo((struct sockaddr*)&w->from, w->fromlen, host, sizeof(host),
+                   port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV))
+        return NULL;
+    if(w->reply)
+        lo_address_free(w->reply);
+    w->reply = lo_address_new(host, port);
+    return w->reply;
+}
+
+//the /osc2midi/ namespace is osc2midi's own, those messages never go
+//through the map
+static int osc2midi_handler(const char *path, lo_message msg, CONVERTER* conv)
+{
+    lo_address src = reply_address(msg);
 
+    if(!strcmp(path, "/osc2midi/stats"))
+    {
+        if(src)
+            send_stats(src, conv);
+        else if(conv->verbose)
+            printf("don't know where to send the stats\n\n");
+    }
+    else if(!strcmp(path, "/osc2midi/reload"))
+    {
+        if(!conv->mon_mode && !request_reload(conv))
+            printf("already reloading the map\n");
+    }
+    else if(conv->verbose)
+        printf("unknown request %s\n\n", path);
     return 0;
 }
 
@@ -78,63 +454,102 @@ int mon_handler(const char *path, const char *types, lo_arg ** argv,
 int msg_handler(const char *path, const char *types, lo_arg ** argv,
                 int argc, void *data, void *user_data)
 {
-    int i,j,n;
+    int j,n;
     uint8_t first = 1;
     uint8_t midi[3];
     CONVERTER* conv = (CONVERTER*)user_data;
+    OSC_ITER it;
+    lo_timetag tt;
+    double delay = 0;
+    uint64_t start;
+    unsigned long tries = 0;
+    PAIRSET* map;
+
+    if(!strncmp(path, "/osc2midi/", 10))
+        return osc2midi_handler(path, (lo_message)data, conv);
+    start = stats_now();
+    map = map_enter(conv);
+    tt = lo_message_get_timestamp((lo_message)data);
+
+    //messages from a bundle carry the time the midi is meant for
+    if(tt.sec != LO_TT_IMMEDIATE.sec || tt.frac != LO_TT_IMMEDIATE.frac)
+    {
+        lo_timetag now;
+        lo_timetag_now(&now);
+        delay = lo_timetag_diff(tt, now);
+    }
 
-    for(j=0; j<conv->npairs; j++)
+    //only try the pairs with a matching path prefix and types
+    osc_index_find(map->osc_index, path, types, &it);
+    while( (j = osc_iter_next(&it)) >= 0 )
     {
-        PAIRHANDLE ph = conv->p[j];
+        PAIRHANDLE ph = map->p[j];
+        tries++;
         if( (n = try_match_osc(ph,(char *)path,(char *)types,argv,argc,conv->strict_match,&(conv->glob_chan),&(conv->glob_vel),&(conv->filter),midi)) )
         {
-            if(!conv->multi_match)
-                j = conv->npairs;
+            if(n > 0)
+                __atomic_fetch_add(&map->osc_hits[j], 1, __ATOMIC_RELAXED);
+            else if(n <= -2)
+                __atomic_fetch_add(&map->throttled[j], 1, __ATOMIC_RELAXED);
+            //the rule holds it now, the held thread has to send it in time
+            if(n == -3 && __atomic_load_n(&held_running, __ATOMIC_ACQUIRE))
+                sem_post(&held_sem);
             if(conv->verbose)
             {
-                if(first)
-                    printf("matches found:\n");
+                trace_osc(TRACE_O2M, first, path, types, argv, argc, midi, n, get_pair_raw_opcode(ph));
                 first = 0;
-                printf("  %s ", path);
-                for (i = 0; i < argc; i++)
-                {
-                    printf("%c", types[i]);
-                }
-                for (i = 0; i < argc; i++)
-                {
-                    printf(", ");
-                    lo_arg_pp((lo_type)types[i], argv[i]);
-                }
-                printf(" -> ");
-                if(n>0)
-                    print_midi(ph, midi);
-                else
-                    printf("%s ( %i )", opcode2cmd(midi[0],1), (int8_t) midi[1]);
-                printf("\n");
-                fflush(stdout);
             }
 
             //push message onto ringbuffer (with timestamp)
             if(n>0)
-                queue_midi(&conv->seq,midi);
+                queue_midi_at(&conv->seq,midi,delay);
+            if(!conv->multi_match)
+                break;
         }
     }
+    map_exit(conv);
     if(conv->verbose && !first)
-        printf("\n");
+        trace_end();
+    __atomic_fetch_add(&conv->stats.osc_tries, tries, __ATOMIC_RELAXED);
+    stats_add(&conv->stats.osc_time, stats_now() - start);
     return 0;
 }
 
 //client side
+
+//largest bundle we'll send, what fits in one udp datagram on an ethernet mtu
+#define BUNDLE_MAX (1500-20-8)
+
+//send the bundle collected so far, if there is one
+static void flush_bundle(lo_address addr, CONVERTER* data, lo_bundle* b)
+{
+    if(*b)
+    {
+        data->send_bundle(addr,*b);
+        lo_bundle_free(*b);
+        *b = NULL;
+        data->osc_datagrams++;
+        //the messages of the pairs in it can be reused now
+        data->bundle_serial++;
+    }
+}
+
 void convert_midi_in(lo_address addr, CONVERTER* data)
 {
-    int i,n;
+    int j,n,ncand;
     uint8_t midi[3];
+    const uint16_t* cand;
+    lo_bundle b = NULL;
+    //the messages in the bundle belong to the pairs, so hold on to the map
+    //until it's sent
+    PAIRSET* map = map_enter(data);
 
     while(pop_midi(&data->seq,midi))
     {
         char path[200];
         lo_message oscm;
         uint8_t first = 1;
+        uint64_t start = stats_now();
 
         if( (midi[0]&0xF0) == 0x90 && midi[2] == 0x00)
         {
@@ -144,38 +559,55 @@ void convert_midi_in(lo_address addr, CONVERTER* data)
             midi[2] = 64;
         }
 
-        for(i=0; i<data->npairs; i++)
+        //only try the pairs that can match this status and data byte
+        ncand = midi_index_find(map->midi_index, midi, &cand);
+        for(j=0; j<ncand; j++)
         {
-            PAIRHANDLE ph = data->p[i];
-            oscm = lo_message_new();
-            if( (n = try_match_midi(ph, midi, data->strict_match, &(data->glob_chan), path, oscm)) )
+            int k = cand[j];//j is moved past the end with -single
+            PAIRHANDLE ph = map->p[k];
+            if(map->bundled[k] == data->bundle_serial)
+            {
+                //the pair's message is still waiting in the bundle, leave it
+                //there and let the pair fill in a new one
+                detach_pair_message(ph);
+                map->bundled[k] = 0;
+            }
+            __atomic_store_n(&data->stats.midi_tries, data->stats.midi_tries+1, __ATOMIC_RELAXED);
+            if( (n = try_match_midi(ph, midi, data->strict_match, &(data->glob_chan), path, &oscm)) )
             {
+                __atomic_store_n(&map->midi_hits[k], map->midi_hits[k]+1, __ATOMIC_RELAXED);
                 if(!data->multi_match)
-                    i = data->npairs;
+                    j = ncand;
                 if(data->verbose)
                 {
-                    if(first)
-                        printf("matches found:\n");
+                    trace_midi(first, midi, get_pair_raw_opcode(ph), path, oscm);
                     first = 0;
-                    printf("  ");
-                    print_midi(ph, midi);
-                    printf(" -> %s ", path);
-                    /*printf("%s", lo_message_get_types(oscm));
-                    for (i = 0; i < lo_message_get_argc(oscm); i++) {
-                        printf(", ");
-                        lo_arg_pp((lo_type)types[i], argv[i]);
-                    }*/
-                    //we'll see how the pp looks
-                    lo_message_pp(oscm);
-                    fflush(stdout);
                 }
 
                 //send message
-                lo_send_message(addr,path,oscm);
+                data->osc_sent++;
+                if(!data->bundle)
+                {
+                    data->send_message(addr,path,oscm);
+                    data->osc_datagrams++;
+                    continue;
+                }
+                if(b && lo_bundle_length(b) + 4 + lo_message_length(oscm,path) > BUNDLE_MAX)
+                {
+                    flush_bundle(addr,data,&b);
+                }
+                if(!b)
+                {
+                    b = lo_bundle_new(LO_TT_IMMEDIATE);
+                }
+                lo_bundle_add_message(b,path,oscm);
+                map->bundled[k] = data->bundle_serial;
             }
-            lo_message_free(oscm);
         }
         if(data->verbose && !first)
-            printf("\n");
+            trace_end();
+        stats_add(&data->stats.midi_time, stats_now() - start);
     }
+    flush_bundle(addr,data,&b);
+    map_exit(data);
 }
@@ -7,5 +7,7 @@
 
 lo_server_thread start_osc_server(char* port,CONVERTER* data);
 int stop_osc_server(lo_server_thread st);
+int start_osc_workers(char* port, CONVERTER* data);
+void stop_osc_workers(uint8_t verbose);
 void convert_midi_in(lo_address addr, CONVERTER* data);
 #endif
@@ -8,20 +8,47 @@
 #include<stdlib.h>
 #include<string.h>
 #include<ctype.h>
+#include<float.h>
+#include<time.h>
 #include"pair.h"
 
 #include "ht_stuff.h"
 
+//read-only compiled form of the osc path. This is a little program for
+//match_path(), each segment is a span of literal text followed by an integer
+//which gets captured into a slot, the last segment has no slot (-1) and
+//must reach the end of the path
+typedef struct _PATHSEG
+{
+    const char* lit;
+    int len;
+    int slot;
+} PATHSEG;
+
+//reads an osc arg as a number, returns 0 if the type can't be used as a
+//number here or -1 if it already wrote the whole midi message (raw midi)
+typedef int (*OSC_DECODER)(lo_arg* arg, double* val, uint8_t msg[]);
+
+//puts a conditioned value into its byte(s) of the midi message
+typedef void (*MIDI_PLACER)(uint8_t msg[], int place, float conditioned);
+
 typedef struct _PAIR
 {
 
     //osc data
     char**   path;
     int* perc;//point in path string with printf format %
+    PATHSEG* seg;
+    char* segbuf;//storage for the segment literals
     int argc;
     int argc_in_path;
     char* types;
 
+    //osc message for midi->osc, made once with all the args and filled in
+    //place by try_match_midi (which only runs in the midi->osc converter)
+    lo_message oscm;
+    lo_arg** oscv;
+
     //hash key and register values (pairs with the same hash key share the same register vector)
     int key;
     float* regs;
@@ -34,6 +61,19 @@ typedef struct _PAIR
     float *osc_scale;          //scale factor for each var in the osc message
     float *osc_offset;         //linear offset for each var in the osc message
 
+    //the above folded into val*a + b, one pair per direction
+    float midi_a[4];           //osc var -> midi arg, for each midi arg
+    float midi_b[4];
+    float midi_lo[4];          //clamp bounds for each midi arg
+    float midi_hi[4];
+    float *osc_a;              //midi arg -> osc var, for each var in the osc message
+    float *osc_b;
+
+    //handlers picked while loading so try_match_osc doesn't switch on the types
+    OSC_DECODER* decode;       //one for each osc arg (not the path variables)
+    uint8_t* osc_places;       //bit mask of the midi args each var of the osc message goes into
+    MIDI_PLACER put_midi[4];   //for each midi arg
+
     //midi constants 0- channel 1- data1 2- data2
     uint8_t opcode;
     uint8_t midi_rangemax[4]; //range bound for midi args (or same as val)
@@ -54,6 +94,12 @@ typedef struct _PAIR
     uint8_t midi_const[4];  //flags for midi message (channel, data1, data2) is a constant (1) or range (2)
     uint8_t *osc_const;    //flags for osc args that are constant (1) or range (2)
 
+    //throttling, '@ rate' and '~ delta' after the midi command (0 if not used)
+    uint32_t min_interval;  //ms between two messages sent by this rule
+    float deadband;         //least change of the midi value since the last one sent
+    uint64_t last;          //the last one sent, packed by throttle_osc()
+    uint64_t held;          //the newest one @ left out and when it's due, or 0
+
 } PAIR;
 
 
@@ -65,11 +111,9 @@ void print_pair(PAIRHANDLE ph)
     //path
     for(i=0; i<p->argc_in_path; i++)
     {
-        p->path[i][p->perc[i]] = '{';
-        printf("%s}",p->path[i]);
-        p->path[i][p->perc[i]] = '%';
+        printf("%s{i}",p->seg[i].lit);
     }
-    printf("%s",p->path[i]);
+    printf("%s",p->seg[i].lit);
 
     //types
     printf(" %s, ",p->types);
@@ -189,7 +233,109 @@ void print_pair(PAIRHANDLE ph)
     else if(p->n>3)
         printf(", y4");//it shouldn't ever actually get here
 
-    printf(" )\n");
+    printf(" )");
+    if(p->min_interval)
+        printf(" @ %.2f",1000.0/p->min_interval);
+    if(p->deadband)
+        printf(" ~ %.2f",p->deadband);
+    printf("\n");
+}
+
+//copy the literal part of the OSC path in front of the first path variable
+//returns 1 if the path has variables in it, 0 if prefix is the whole path
+int get_pair_osc_prefix(PAIRHANDLE ph, char* prefix)
+{
+    PAIR* p = (PAIR*)ph;
+    strcpy(prefix,p->seg[0].lit);
+    return p->argc_in_path > 0;
+}
+
+char* get_pair_types(PAIRHANDLE ph)
+{
+    PAIR* p = (PAIR*)ph;
+    return p->types;
+}
+
+//write a path the pair would match, with v[i] in place of each path variable
+//returns the number of path variables
+int get_pair_osc_path(PAIRHANDLE ph, const int v[], char* path)
+{
+    PAIR* p = (PAIR*)ph;
+    int i;
+    for(i=0; i<p->argc_in_path; i++)
+        path += sprintf(path, "%s%i", p->seg[i].lit, v[i]);
+    strcpy(path, p->seg[i].lit);
+    return p->argc_in_path;
+}
+
+//get the status bytes and first data bytes of the midi messages this pair can
+//possibly match in try_match_midi. Returns the number of status ranges in
+//smin/smax (0, 1 or 2), the data byte range is the same for all of them.
+int get_pair_midi_keys(PAIRHANDLE ph, uint8_t smin[], uint8_t smax[], uint8_t* dmin, uint8_t* dmax)
+{
+    PAIR* p = (PAIR*)ph;
+    uint8_t cmin = 0, cmax = 15;
+    int n = 0;
+
+    *dmin = 0;
+    *dmax = 127;
+    if(p->raw_midi)
+    {
+        //constant parts of the raw message
+        smin[0] = 0x80;
+        smax[0] = 0xFF;
+        if(p->midi_map[0] == -1)
+        {
+            if(p->midi_val[0] > smin[0]) smin[0] = p->midi_val[0];
+            if(p->midi_rangemax[0] < smax[0]) smax[0] = p->midi_rangemax[0];
+        }
+        if(p->n > 1 && p->midi_map[1] == -1)
+        {
+            *dmin = p->midi_val[1];
+            *dmax = p->midi_rangemax[1];
+        }
+        return smin[0] <= smax[0] && *dmin <= *dmax;
+    }
+    if(p->opcode < 0x80)
+    {
+        //setchannel etc. never match midi
+        return 0;
+    }
+
+    //the global channel can change at any time, so only constants count
+    if(!p->use_glob_chan && p->midi_const[0])
+    {
+        cmin = p->midi_val[0];
+        cmax = p->midi_rangemax[0] > 15 ? 15 : p->midi_rangemax[0];
+        if(cmin > cmax)
+            return 0;
+    }
+    if(p->opcode == 0xE0)
+    {
+        //pitchbend, the lsb is only fixed if the range has a single msb
+        if(p->midi_const[1] && p->midi_val[2] == p->midi_rangemax[2])
+        {
+            *dmin = p->midi_val[1];
+            *dmax = p->midi_rangemax[1];
+        }
+    }
+    else if(p->midi_const[1])
+    {
+        *dmin = p->midi_val[1];
+        *dmax = p->midi_rangemax[1];
+    }
+    if(*dmin > *dmax)
+        return 0;
+
+    smin[n] = p->opcode + cmin;
+    smax[n++] = p->opcode + cmax;
+    if(p->opcode == 0x80 && p->n == 4)
+    {
+        //note() with a variable state also matches note on
+        smin[n] = 0x90 + cmin;
+        smax[n++] = 0x90 + cmax;
+    }
+    return n;
 }
 
 int check_pair_set_for_filter(PAIRHANDLE* pa, int npairs)
@@ -229,7 +375,7 @@ void rm_whitespace(char* str)
 
    We parse the following syntax (in EBNF):
 
-   rule ::= path argtypes ',' [ arglist ] ':' command '(' arglist ')'
+   rule ::= path argtypes ',' [ arglist ] ':' command '(' arglist ')' [ throttle ]
 
    path ::= OSC path string, must be non-empty
 
@@ -250,6 +396,8 @@ void rm_whitespace(char* str)
    var ::= may contain anything but operators, comma and ':' or ')' delimiter,
            must not be empty
 
+   throttle ::= { '@' number | '~' number }
+
    NOTES:
 
    To accommodate the widest possible range of OSC applications, the syntax is
@@ -357,7 +505,7 @@ errout:
 
 int check_config(char* config)
 {
-    char *s = config, *msg = 0;
+    char *s = config, *t, *msg = 0;
 
     while (isspace(*s)) s++;
     // OSC path
@@ -406,6 +554,17 @@ int check_config(char* config)
     }
     if (*s != ')') error_exit(msg, "expected ')'");
     s++;
+    while (isspace(*s)) s++;
+    // Optional throttling, a maximum rate and/or a deadband, in any order.
+    while (*s == '@' || *s == '~')
+    {
+        s++;
+        while (isspace(*s)) s++;
+        (void)strtod(s, &t);
+        if (t == s) error_exit(msg, "expected number");
+        s = t;
+        while (isspace(*s)) s++;
+    }
     // Check the line end (everything that comes after the rule). We allow a
     // trailing semicolon, end-of-line comment and whitespace there, flag
     // everything else as an error.
@@ -460,7 +619,11 @@ int get_pair_path(char* config, char* path, PAIR* p)
         n = tmp - prev;
         i = 0;
         tmp = prev;
-        while( (tmp = strchr(tmp,'%')) ) i++;
+        while( (tmp = strchr(tmp,'%')) )
+        {
+            i++;
+            tmp++;
+        }
         p->path[p->argc_in_path] = (char*)malloc(sizeof(char)*n+i+3);
         //double check the variable is good
         i = sscanf(prev,"%*[^{]{%[^}]}",var);
@@ -486,6 +649,28 @@ int get_pair_path(char* config, char* path, PAIR* p)
     //allocate space for end of path and copy
     p->path[p->argc_in_path] = (char*)malloc(sizeof(char)*(strlen(prev)+1));
     strcpy(p->path[p->argc_in_path],prev);
+
+    //compile the segments used for matching, these are never modified so any
+    //number of threads can match against them at the same time
+    p->seg = (PATHSEG*)malloc(sizeof(PATHSEG)*(p->argc_in_path+1));
+    p->segbuf = (char*)malloc(sizeof(char)*(strlen(path)+1));
+    tmp = p->segbuf;
+    for(i=0; i<=p->argc_in_path; i++)
+    {
+        prev = p->path[i];
+        n = i<p->argc_in_path ? p->perc[i] : strlen(prev);
+        p->seg[i].lit = tmp;
+        for(j=0; j<n; j++)
+        {
+            //undo the delimiting of % characters
+            if(i<p->argc_in_path && prev[j] == '%')
+                j++;
+            *tmp++ = prev[j];
+        }
+        *tmp++ = 0;
+        p->seg[i].len = tmp - p->seg[i].lit - 1;
+        p->seg[i].slot = i<p->argc_in_path ? i : -1;
+    }
     return 0;
 }
 
@@ -508,6 +693,8 @@ int get_pair_argtypes(char* config, char* path, PAIR* p, table tab, float** regs
     p->osc_map = (int8_t*)malloc( sizeof(int8_t) * (p->argc_in_path+len+1) );
     p->osc_scale = (float*)malloc( sizeof(float) * (p->argc_in_path+len+1) );
     p->osc_offset = (float*)malloc( sizeof(float) * (p->argc_in_path+len+1) );
+    p->osc_a = (float*)malloc( sizeof(float) * (p->argc_in_path+len+1) );
+    p->osc_b = (float*)malloc( sizeof(float) * (p->argc_in_path+len+1) );
     p->osc_const = (uint8_t*)malloc( sizeof(uint8_t) * (p->argc_in_path+len+1) );
     p->osc_val = (float*)malloc( sizeof(float) * (p->argc_in_path+len+1) );
     p->osc_rangemax = (float*)malloc( sizeof(float) * (p->argc_in_path+len+1) );
@@ -668,6 +855,46 @@ int get_pair_midicommand(char* config, PAIR* p)
     return n;
 }
 
+//the optional '@ rate' and '~ delta' that follow the midi command
+int get_pair_throttle(char* config, PAIR* p)
+{
+    char* s = config;
+    char op;
+    double v;
+
+    //check_config() already made sure the rule is well formed, so the midi
+    //command's args are the first ( ) after the ':' that ends the osc args
+    while(isspace(*s)) s++;
+    while(*s && !isspace(*s)) s++;
+    s = strchr(strchr(s,':'),')') + 1;
+    while(isspace(*s)) s++;
+    while(*s == '@' || *s == '~')
+    {
+        op = *s++;
+        v = strtod(s,&s);
+        while(isspace(*s)) s++;
+        if(op == '@')
+        {
+            if(v <= 0 || v > 1000)
+            {
+                printf("\nERROR in config line:\n%s -rate must be more than 0 and at most 1000 (per second)!\n\n",config);
+                return -1;
+            }
+            p->min_interval = 1000/v + .5;
+        }
+        else
+        {
+            if(v < 0)
+            {
+                printf("\nERROR in config line:\n%s -deadband can't be negative!\n\n",config);
+                return -1;
+            }
+            p->deadband = v;
+        }
+    }
+    return 0;
+}
+
 //this gets the alpha-numeric variable name, ignoring conditioning
 //returns 0 if no var found
 int get_pair_arg_varname(char* arg, char* varname)
@@ -947,7 +1174,7 @@ int get_pair_mapping(char* config, PAIR* p, int n)
     char argnames[200],midiargs[200],
          arg0[70], arg1[70], arg2[70], arg3[70],
          var[50];
-    char *tmp, *marg[4];
+    char *tmp, *save, *marg[4];
     float f,f2;
     int i,j;
     int8_t k;
@@ -1092,7 +1319,7 @@ int get_pair_mapping(char* config, PAIR* p, int n)
     }
 
     //now go through OSC args
-    tmp = strtok(argnames,",");
+    tmp = strtok_r(argnames,",",&save);
     for(i=0; i<p->argc_in_path + p->argc; i++)
     {
         if(!tmp)
@@ -1154,11 +1381,252 @@ int get_pair_mapping(char* config, PAIR* p, int n)
             p->osc_const[i] = get_pair_arg_constant(tmp,&p->osc_val[i],&p->osc_rangemax[i]);
         }
         //next arg name
-        tmp = strtok(NULL,",");
+        tmp = strtok_r(NULL,",",&save);
+    }
+
+    //fold the conditioning of both sides into one multiply and add for each
+    //direction, midi = midi_scale*(osc - osc_offset)/osc_scale + midi_offset
+    for(i=0; i<4; i++)
+    {
+        p->midi_a[i] = 0;
+        p->midi_b[i] = 0;
+        j = p->midi_map[i];
+        if(i < p->n && j != -1)
+        {
+            p->midi_a[i] = p->midi_scale[i]/p->osc_scale[j];
+            p->midi_b[i] = p->midi_offset[i] - p->midi_a[i]*p->osc_offset[j];
+        }
     }
+    for(i=0; i<p->argc_in_path + p->argc; i++)
+    {
+        p->osc_a[i] = 0;
+        p->osc_b[i] = 0;
+        k = p->osc_map[i];
+        if(k != -1)
+        {
+            p->osc_a[i] = p->osc_scale[i]/p->midi_scale[k];
+            p->osc_b[i] = p->osc_offset[i] - p->osc_a[i]*p->midi_offset[k];
+        }
+    }
+    return 0;
+}
+
+//the registers are shared by all pairs with the same osc message and are
+//written from the osc server thread(s) as well as the midi->osc converter,
+//each one is a single float so relaxed atomic accesses are all it takes
+static inline void set_reg(float* r, float v)
+{
+    __atomic_store(r, &v, __ATOMIC_RELAXED);
+}
+
+static inline float get_reg(float* r)
+{
+    float v;
+    __atomic_load(r, &v, __ATOMIC_RELAXED);
+    return v;
+}
+
+//osc arg decoders
+static int decode_i(lo_arg* arg, double* val, uint8_t msg[])
+{
+    *val = (double)arg->i;
+    return 1;
+}
+
+static int decode_h(lo_arg* arg, double* val, uint8_t msg[])
+{
+    *val = (double)arg->h;
+    return 1;
+}
+
+static int decode_f(lo_arg* arg, double* val, uint8_t msg[])
+{
+    *val = (double)arg->f;
+    return 1;
+}
+
+static int decode_d(lo_arg* arg, double* val, uint8_t msg[])
+{
+    *val = (double)arg->d;
+    return 1;
+}
+
+static int decode_c(lo_arg* arg, double* val, uint8_t msg[])
+{
+    *val = (double)arg->c;
+    return 1;
+}
+
+//true and impulse
+static int decode_one(lo_arg* arg, double* val, uint8_t msg[])
+{
+    *val = 1.0;
+    return 1;
+}
+
+//false and nil, and any arg that isn't a number but isn't used either
+static int decode_zero(lo_arg* arg, double* val, uint8_t msg[])
+{
+    *val = 0.0;
+    return 1;
+}
+
+//strings, blobs, symbols, timetags etc. can't be put in a midi message
+static int decode_none(lo_arg* arg, double* val, uint8_t msg[])
+{
     return 0;
 }
 
+//send full midi message
+static int decode_midi(lo_arg* arg, double* val, uint8_t msg[])
+{
+    msg[0] = arg->m[1];
+    msg[1] = arg->m[2];
+    msg[2] = arg->m[3];
+    return -1;
+}
+
+//midi arg placers, the value is already clamped to the bounds of its place
+static void put_byte(uint8_t msg[], int place, float conditioned)
+{
+    msg[place] += ((uint8_t)conditioned);
+}
+
+//pitchbend is special case (14 bit number)
+static void put_bend(uint8_t msg[], int place, float conditioned)
+{
+    msg[place] += ((uint8_t)conditioned)&0x7F;
+    msg[place+1] += ((uint8_t)(conditioned/128.0));
+}
+
+//only used for note on or off
+static void put_noteon(uint8_t msg[], int place, float conditioned)
+{
+    msg[0] += ((uint8_t)(conditioned>0))<<4;
+}
+
+//messages to set global channel etc. keep the value in msg[1] (place is 0)
+static void put_setting(uint8_t msg[], int place, float conditioned)
+{
+    msg[place+1] = ((uint8_t)conditioned);
+}
+
+//pick the decoder for each osc arg and the placer for each midi arg once the
+//mapping is known
+void get_pair_handlers(PAIR* p)
+{
+    int i,k;
+
+    p->decode = (OSC_DECODER*)malloc( sizeof(OSC_DECODER) * (p->argc+1) );
+    p->osc_places = (uint8_t*)calloc( p->argc_in_path+p->argc+1, sizeof(uint8_t) );
+    for(i=0; i<p->argc; i++)
+    {
+        int used = p->osc_map[i+p->argc_in_path] != -1;
+        switch(p->types[i])
+        {
+        case 'i':
+            p->decode[i] = decode_i;
+            break;
+        case 'h'://long
+            p->decode[i] = decode_h;
+            break;
+        case 'f':
+            p->decode[i] = decode_f;
+            break;
+        case 'd':
+            p->decode[i] = decode_d;
+            break;
+        case 'c'://char
+            p->decode[i] = decode_c;
+            break;
+        case 'T'://true
+        case 'I'://impulse
+            p->decode[i] = decode_one;
+            break;
+        case 'F'://false
+        case 'N'://nil
+            p->decode[i] = decode_zero;
+            break;
+        case 'm'://midi
+            if(used && p->raw_midi && p->n==1)
+            {
+                p->decode[i] = decode_midi;
+                break;
+            }
+        case 's'://string
+        case 'b'://blob
+        case 'S'://symbol
+        case 't'://timetag
+        default:
+            //this isn't supported as an arg, but unused args just read as 0
+            p->decode[i] = used ? decode_none : decode_zero;
+        }
+    }
+    for(k=0; k<4; k++)
+    {
+        //clamp MIDI values
+        // - 0..255 for status bytes (arg #0 of rawmidi)
+        // - 0..15 for channel (arg #0 of other commands)
+        // - 0..127 for regular data bytes
+        // - 0..16383 for pitch bend
+        p->put_midi[k] = put_byte;
+        p->midi_lo[k] = 0;
+        if(p->set_channel || p->set_velocity || p->set_shift)
+        {
+            p->put_midi[k] = put_setting;
+            p->midi_hi[k] = p->set_channel ? 15 : 127;
+            if(p->set_shift)
+                p->midi_lo[k] = -FLT_MAX, p->midi_hi[k] = FLT_MAX;
+        }
+        else if(k == 3)
+        {
+            p->put_midi[k] = put_noteon;
+            p->midi_lo[k] = -FLT_MAX;
+            p->midi_hi[k] = FLT_MAX;
+        }
+        else if(p->opcode == 0xE0 && k == 1)
+        {
+            p->put_midi[k] = put_bend;
+            p->midi_hi[k] = 16383;
+        }
+        else if(k > 0)
+            p->midi_hi[k] = 127;
+        else if(p->raw_midi)
+            p->midi_hi[k] = 255;
+        else
+            p->midi_hi[k] = 15;
+        //place only indicates one of the places that a variable occurs in
+        //the midi mapping, so keep all midi args bound to each var -ag
+        if(k < p->n && p->midi_map[k] != -1)
+            p->osc_places[p->midi_map[k]] |= 1<<k;
+    }
+}
+
+//make the midi->osc message with every arg at its null value, try_match_midi
+//only has to write in the values
+void get_pair_message(PAIR* p)
+{
+    int i;
+    p->oscm = lo_message_new();
+    //keep our own reference, bundles take one while the message is in them
+    lo_message_incref(p->oscm);
+    for(i=0; i<p->argc; i++)
+        load_osc_value(p->oscm, p->types[i], 0);
+    p->oscv = lo_message_get_argv(p->oscm);
+}
+
+//give the pair a new copy of its midi->osc message, the old one stays with
+//whoever still has a reference to it (i.e. a bundle that wasn't sent yet)
+void detach_pair_message(PAIRHANDLE ph)
+{
+    PAIR* p = (PAIR*)ph;
+    lo_message m = lo_message_clone(p->oscm);
+    lo_message_incref(m);
+    lo_message_free(p->oscm);
+    p->oscm = m;
+    p->oscv = lo_message_get_argv(m);
+}
+
 PAIRHANDLE abort_pair_alloc(int step, PAIR* p)
 {
     switch(step)
@@ -1168,6 +1636,8 @@ PAIRHANDLE abort_pair_alloc(int step, PAIR* p)
         free(p->osc_map);
         free(p->osc_scale);
         free(p->osc_offset);
+        free(p->osc_a);
+        free(p->osc_b);
         free(p->osc_const);
         free(p->osc_val);
         free(p->osc_rangemax);
@@ -1178,6 +1648,8 @@ PAIRHANDLE abort_pair_alloc(int step, PAIR* p)
         }
         free(p->perc);
         free(p->path);
+        free(p->seg);
+        free(p->segbuf);
     case 1:
         free(p);
     default:
@@ -1227,6 +1699,11 @@ PAIRHANDLE alloc_pair(char* config, table tab, float** regs, int* nkeys)
     if(-1 == get_pair_mapping(config,p,n))
         return abort_pair_alloc(3,p);
 
+    if(-1 == get_pair_throttle(config,p))
+        return abort_pair_alloc(3,p);
+
+    get_pair_handlers(p);
+    get_pair_message(p);
     return p;//success
 }
 
@@ -1237,19 +1714,224 @@ void free_pair(PAIRHANDLE ph)
     free(p->osc_map);
     free(p->osc_scale);
     free(p->osc_offset);
+    free(p->osc_a);
+    free(p->osc_b);
     free(p->osc_const);
     free(p->osc_val);
     free(p->osc_rangemax);
+    free(p->decode);
+    free(p->osc_places);
+    lo_message_free(p->oscm);
     while(p->argc_in_path >=0)
     {
         free(p->path[p->argc_in_path--]);
     }
     free(p->perc);
     free(p->path);
+    free(p->seg);
+    free(p->segbuf);
     free(p);
 }
 
+//value of a digit in any base up to 16, anything else is too big for all bases
+static inline int digit_val(char c)
+{
+    if(c >= '0' && c <= '9')
+        return c - '0';
+    c |= 0x20;//lower case
+    if(c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return 16;
+}
+
+//read an integer like strtol(s,&end,0) (or %i in scanf) does, returns the
+//end of the number or NULL if there isn't one
+static inline const char* parse_int(const char* s, int* v)
+{
+    int neg = 0, base = 10;
+    unsigned int n = 0;
+    const char* start;
+
+    while(isspace(*s)) s++;
+    if(*s == '-' || *s == '+')
+        neg = *s++ == '-';
+    if(*s == '0')
+    {
+        base = 8;
+        if((s[1]|0x20) == 'x' && digit_val(s[2]) < 16)
+        {
+            base = 16;
+            s += 2;
+        }
+    }
+    for(start = s; digit_val(*s) < base; s++)
+        n = n*base + digit_val(*s);
+    if(s == start)
+        return 0;
+    *v = neg ? -n : n;
+    return s;
+}
+
+//run the compiled path against an incoming path in a single pass, the path
+//variables are stored in v[], returns 1 if it matches
+static int match_path(const PATHSEG* seg, const char* path, int v[])
+{
+    int k;
+    for(;; seg++)
+    {
+        for(k=0; k<seg->len; k++)
+        {
+            //this also stops at the end of the path
+            if(path[k] != seg->lit[k])
+                return 0;
+        }
+        path += k;
+        if(seg->slot < 0)
+            return *path == 0;
+        if(!(path = parse_int(path, &v[seg->slot])))
+            return 0;
+    }
+}
+
+/* Rate limit and deadband of a rule. What the rule sent last is packed into
+   one 64 bit word so the check and the update are a single compare and swap,
+   even with several osc threads matching the same rule:
+   bits 0-13 the value (14 bits for pitchbend), bit 15 set once something was
+   sent, bits 16-30 status and first data byte (7 bits, like the data bytes),
+   bits 32-63 the time in ms.
+   Only controllers, aftertouch and pitchbend are throttled, they are a
+   position where only the newest counts. Notes and program changes each mean
+   something (a dropped note off hangs the note), so they always go through.
+   A message for another channel, controller or note than the last one (the
+   rule has variables in those) always goes through too.
+   What the rate leaves out isn't lost: the newest of it is held, packed the
+   same way but with the time it's due, until take_pair_held() sends it once
+   the interval is over. Returns 1 if msg should be sent, 0 if it should be
+   dropped and -1 if it is the first one held in this interval. */
+#define THROTTLE_KEY(v) ((uint32_t)((v)>>16 & 0x7FFF))
+
+static uint32_t throttle_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+//let go of what's held for key, something newer made it obsolete
+static void drop_held(PAIR* p, uint32_t key)
+{
+    uint64_t h = __atomic_load_n(&p->held, __ATOMIC_RELAXED);
+
+    if(h && THROTTLE_KEY(h) == key)
+        __atomic_compare_exchange_n(&p->held, &h, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static int throttle_osc(PAIR* p, const uint8_t msg[])
+{
+    uint32_t now, key, val;
+    uint64_t last, next;
+    int d;
+
+    switch(msg[0]&0xF0)
+    {
+    case 0xE0:
+        key = msg[0];
+        val = (msg[1]&0x7F) | (msg[2]&0x7F)<<7;
+        break;
+    case 0xD0:
+        key = msg[0];
+        val = msg[1]&0x7F;
+        break;
+    case 0xB0:
+    case 0xA0:
+        key = msg[0] | (msg[1]&0x7F)<<8;
+        val = msg[2]&0x7F;
+        break;
+    default:
+        return 1;
+    }
+    now = throttle_now();
+    next = (uint64_t)now<<32 | key<<16 | 0x8000 | val;
+
+    last = __atomic_load_n(&p->last, __ATOMIC_RELAXED);
+    do
+    {
+        if((last & 0x8000) && THROTTLE_KEY(last) == key)
+        {
+            d = (int)val - (int)(last & 0x3FFF);
+            if(p->deadband && (d < 0 ? -d : d) < p->deadband)
+            {
+                //back near what was sent, anything held is further off
+                drop_held(p, key);
+                return 0;
+            }
+            if((uint32_t)(now - (uint32_t)(last>>32)) < p->min_interval)
+            {
+                next = (uint64_t)((uint32_t)(last>>32) + p->min_interval)<<32 | key<<16 | 0x8000 | val;
+                return __atomic_exchange_n(&p->held, next, __ATOMIC_RELAXED) ? 0 : -1;
+            }
+        }
+    }
+    while(!__atomic_compare_exchange_n(&p->last, &last, next, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    drop_held(p, key);
+    return 1;
+}
+
+//if the rule holds a message that is due it is put in msg and 1 returned,
+//it counts as sent from then on. Otherwise 0 is returned and *wait lowered
+//to the ms until what's held is due, if that is sooner.
+int take_pair_held(PAIRHANDLE ph, uint8_t msg[], uint32_t* wait)
+{
+    PAIR* p = (PAIR*)ph;
+    uint64_t h = __atomic_load_n(&p->held, __ATOMIC_RELAXED);
+    uint32_t now, due, key, val;
+
+    if(!h)
+        return 0;
+    now = throttle_now();
+    due = h>>32;
+    if((int32_t)(due - now) > 0)
+    {
+        if(due - now < *wait)
+            *wait = due - now;
+        return 0;
+    }
+    //a handler held something newer meanwhile, look again right away
+    if(!__atomic_compare_exchange_n(&p->held, &h, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        *wait = 0;
+        return 0;
+    }
+    __atomic_store_n(&p->last, (uint64_t)now<<32 | (h & 0xFFFFFFFF), __ATOMIC_RELAXED);
+    key = THROTTLE_KEY(h);
+    val = h & 0x3FFF;
+    msg[0] = key & 0xFF;
+    switch(msg[0]&0xF0)
+    {
+    case 0xE0:
+        msg[1] = val & 0x7F;
+        msg[2] = val>>7;
+        break;
+    case 0xD0:
+        msg[1] = val;
+        msg[2] = 0;
+        break;
+    default:
+        msg[1] = key>>8;
+        msg[2] = val;
+        break;
+    }
+    return 1;
+}
+
 //returns 1 if match is successful and msg has a message to be sent to the output
+//-1 if it matched but there's nothing to send (settings), -2 if the rule
+//is throttled right now and -3 if it is throttled and the rule started to
+//hold msg to send later (see take_pair_held)
+//This only writes the registers and the throttle slot of the pair, both
+//atomically, so it is safe to call from several threads at once. The
+//registers are only updated once the whole message matched.
 int try_match_osc(PAIRHANDLE ph, char* path, char* types, lo_arg** argv, int argc, uint8_t strict_match, uint8_t* glob_chan, uint8_t* glob_vel, int8_t *filter, uint8_t msg[])
 {
     PAIR* p = (PAIR*)ph;
@@ -1280,293 +1962,74 @@ int try_match_osc(PAIRHANDLE ph, char* path, char* types, lo_arg** argv, int arg
         msg[2] = p->midi_val[2];
         if(p->use_glob_chan)
         {
-            msg[0] += *glob_chan;
+            msg[0] += __atomic_load_n(glob_chan, __ATOMIC_RELAXED);
         }
         if(p->use_glob_vel)
         {
-            msg[2] += *glob_vel;
+            msg[2] += __atomic_load_n(glob_vel, __ATOMIC_RELAXED);
         }
     }
 
     //now start trying to get the data
-    int i,v,n;
-    char *tmp;
+    int i,k,r;
     int place;
+    unsigned int places;
+    double val;
     float conditioned;
+    //values for the registers, kept here until we know the message matches
+    float vals[p->argc_in_path+p->argc+1];
+    int pathvals[p->argc_in_path+1];
     //check path
-    for(i=0; i<p->argc_in_path; i++)
-    {
-        //does it match?
-        p->path[i][p->perc[i]] = 0;
-        tmp = strstr(path,p->path[i]);
-        n = strlen(p->path[i]);
-        p->path[i][p->perc[i]] = '%';
-        if( tmp !=path )
-        {
-            return 0;
-        }
-        //get the argument
-        if(!sscanf(tmp,p->path[i],&v))
-        {
-            return 0;
-        }
-        //put it in the message;
-        place = p->osc_map[i];
-        if(place != -1)
-        {
-            //place only indicates one of the places that a variable occurs in
-            //the midi mapping, so in order to catch all instances of the same
-            //variable, we have to iterate over all midi arguments bound to the
-            //given osc argument here -ag
-            for(place=0; place<p->n; place++)
-            {
-                if(p->midi_map[place]==i)
-                {
-                    conditioned = p->midi_scale[place]*(v - p->osc_offset[i])/p->osc_scale[i] + p->midi_offset[place];
-                    //same code as below for arguments to set global channel etc.
-                    //assert place==0 here
-                    if(p->set_channel)
-                    {
-                        if(conditioned<0) conditioned = 0;
-                        if(conditioned>15) conditioned = 15;
-                        msg[place+1] = ((uint8_t)conditioned);
-                    }
-                    else if(p->set_velocity)
-                    {
-                        if(conditioned<0) conditioned = 0;
-                        if(conditioned>127) conditioned = 127;
-                        msg[place+1] = ((uint8_t)conditioned);
-                    }
-                    else if(p->set_shift)
-                    {
-                        msg[place+1] = ((uint8_t)conditioned);
-                    }
-                    //put it in the midi message
-                    else if(place == 3)//only used for note on or off
-                    {
-                        msg[0] += ((uint8_t)(conditioned>0))<<4;
-                    }
-                    else
-                    {
-                        //clamp MIDI values
-                        // - 0..255 for status bytes (arg #0 of rawmidi)
-                        // - 0..15 for channel (arg #0 of other commands)
-                        // - 0..127 for regular data bytes
-                        // - 0..16383 for pitch bend
-                        if(conditioned<0) conditioned = 0;
-                        if(p->opcode == 0xE0 && place == 1)//pitchbend is special case (14 bit number)
-                        {
-                            if(conditioned>16383) conditioned = 16383;
-                            msg[place] += ((uint8_t)conditioned)&0x7F;
-                            msg[place+1] += ((uint8_t)(conditioned/128.0));
-                        }
-                        else if (place > 0) // ordinary data byte
-                        {
-                            if(conditioned>127) conditioned = 127;
-                            msg[place] += ((uint8_t)conditioned);
-                        }
-                        else if (p->raw_midi) // status byte
-                        {
-                            if(conditioned>255) conditioned = 255;
-                            msg[place] += ((uint8_t)conditioned);
-                        }
-                        else // channel
-                        {
-                            if(conditioned>15) conditioned = 15;
-                            msg[place] += ((uint8_t)conditioned);
-                        }
-                    }
-                }
-            }
-        }
-        //check if it matches range or constant
-        else if(p->osc_const[i] && (v < p->osc_val[i] || v > p->osc_rangemax[i]))
-        {
-            //out of bounds of range or const
-            return 0;
-        }
-        //record the value for later use in reverse mapping (MIDI->OSC) -ag
-        p->regs[i] = v;
-        path += n;
-        //skip over the parameter value
-        char *end;
-        (void) strtol(path, &end, 0);
-        // assert result==v && end != NULL
-        path = end;
-    }
-    //compare the end of the path
-    if(strcmp(path,p->path[i]))
+    if(!match_path(p->seg, path, pathvals))
     {
         return 0;
     }
-
-    //now the actual osc args
-    double val;
-    for(i=0; i<p->argc; i++)
+    //the path variables (first) and the actual osc args are handled the same
+    //way once we have their value, k indexes both
+    for(k=0; k<p->argc_in_path+p->argc; k++)
     {
-        //put it in the message;
-        place = p->osc_map[i+p->argc_in_path];
-        if(place != -1)
+        if(k < p->argc_in_path)
+        {
+            val = pathvals[k];
+        }
+        else
         {
-            switch(types[i])
+            i = k-p->argc_in_path;
+            r = p->decode[i](argv[i], &val, msg);
+            if(!r)
             {
-            case 'i':
-                val = (double)argv[i]->i;
-                break;
-            case 'h'://long
-                val = (double)argv[i]->h;
-                break;
-            case 'f':
-                val = (double)argv[i]->f;
-                break;
-            case 'd':
-                val = (double)argv[i]->d;
-                break;
-            case 'c'://char
-                val = (double)argv[i]->c;
-                break;
-            case 'T'://true
-                val = 1.0;
-                break;
-            case 'F'://false
-                val = 0.0;
-                break;
-            case 'N'://nil
-                val = 0.0;
-                break;
-            case 'I'://impulse
-                val = 1.0;
-                break;
-            case 'm'://midi
-                if(p->raw_midi && p->n==1)
-                {
-                    //send full midi message
-                    msg[0] = argv[i]->m[1];
-                    msg[1] = argv[i]->m[2];
-                    msg[2] = argv[i]->m[3];
-                    /* At this point, we're already done constructing the MIDI
-                       message, but we still need to carry on checking all the
-                       remaining arguments, to make sure that the OSC message
-                       matches. -ag */
-                    continue;
-                }
-
-            case 's'://string
-            case 'b'://blob
-            case 'S'://symbol
-            case 't'://timetag
-            default:
                 //this isn't supported, they shouldn't use it as an arg, return error
                 return 0;
-
             }
-            for(place=0; place<p->n; place++)
+            if(r < 0)
             {
-                if(p->midi_map[place]==i+p->argc_in_path)
-                {
-                    conditioned = p->midi_scale[place]*(val - p->osc_offset[i])/p->osc_scale[i] + p->midi_offset[place];
-                    //check if this is a message to set global channel etc.
-                    if(p->set_channel)
-                    {
-                        if(conditioned<0) conditioned = 0;
-                        if(conditioned>15) conditioned = 15;
-                        msg[place+1] = ((uint8_t)conditioned);
-                    }
-                    else if(p->set_velocity)
-                    {
-                        if(conditioned<0) conditioned = 0;
-                        if(conditioned>127) conditioned = 127;
-                        msg[place+1] = ((uint8_t)conditioned);
-                    }
-                    else if(p->set_shift)
-                    {
-                        msg[place+1] = ((uint8_t)conditioned);
-                    }
-                    //put it in the midi message
-                    else if(place == 3)//only used for note on or off
-                    {
-                        msg[0] += ((uint8_t)(conditioned>0))<<4;
-                    }
-                    else
-                    {
-                        //clamp MIDI values
-                        // - 0..255 for status bytes (arg #0 of rawmidi)
-                        // - 0..15 for channel (arg #0 of other commands)
-                        // - 0..127 for regular data bytes
-                        // - 0..16383 for pitch bend
-                        if(conditioned<0) conditioned = 0;
-                        if(p->opcode == 0xE0 && place == 1)//pitchbend is special case (14 bit number)
-                        {
-                            if(conditioned>16383) conditioned = 16383;
-                            msg[place] += ((uint8_t)conditioned)&0x7F;
-                            msg[place+1] += ((uint8_t)(conditioned/128.0));
-                        }
-                        else if (place > 0) // ordinary data byte
-                        {
-                            if(conditioned>127) conditioned = 127;
-                            msg[place] += ((uint8_t)conditioned);
-                        }
-                        else if (p->raw_midi) // status byte
-                        {
-                            if(conditioned>255) conditioned = 255;
-                            msg[place] += ((uint8_t)conditioned);
-                        }
-                        else // channel
-                        {
-                            if(conditioned>15) conditioned = 15;
-                            msg[place] += ((uint8_t)conditioned);
-                        }
-                    }
-                }
+                /* At this point, we're already done constructing the MIDI
+                   message, but we still need to carry on checking all the
+                   remaining arguments, to make sure that the OSC message
+                   matches. -ag */
+                vals[k] = get_reg(&p->regs[k]);
+                continue;
             }
-            //record the value for later use in reverse mapping -ag
-            p->regs[i+p->argc_in_path] = val;
-        }//if arg is used
-        else
+        }
+        //put it in the message, in every place it occurs
+        for(place=0, places=p->osc_places[k]; places; place++, places>>=1)
         {
-            //arg not used but needs to be recorded, and we may have to check if it matches constant or range
-            switch(types[i])
-            {
-            case 'i':
-                val = (double)argv[i]->i;
-                break;
-            case 'h'://long
-                val = (double)argv[i]->h;
-                break;
-            case 'f':
-                val = (double)argv[i]->f;
-                break;
-            case 'd':
-                val = (double)argv[i]->d;
-                break;
-            case 'c'://char
-                val = (double)argv[i]->c;
-                break;
-            case 'T'://true
-                val = 1.0;
-                break;
-            case 'I'://impulse
-                val = 1.0;
-                break;
-            case 'F'://false
-            case 'N'://nil
-            case 'm'://midi
-            case 's'://string
-            case 'b'://blob
-            case 'S'://symbol
-            case 't'://timetag
-            default:
-                val = 0.0;
-            }
-            //check if it is in bounds of constant or range
-            if(p->osc_const[i+p->argc_in_path] && (val < p->osc_val[i+p->argc_in_path] || val > p->osc_rangemax[i+p->argc_in_path]))
+            if(places&1)
             {
-                return 0;
+                conditioned = p->midi_a[place]*(float)val + p->midi_b[place];
+                if(conditioned < p->midi_lo[place]) conditioned = p->midi_lo[place];
+                if(conditioned > p->midi_hi[place]) conditioned = p->midi_hi[place];
+                p->put_midi[place](msg, place, conditioned);
             }
-            //record the value for later use in reverse mapping -ag
-            p->regs[i+p->argc_in_path] = val;
         }
-    }//for args
+        //check if it is in bounds of constant or range
+        if(p->osc_map[k] == -1 && p->osc_const[k] && (val < p->osc_val[k] || val > p->osc_rangemax[k]))
+        {
+            return 0;
+        }
+        //record the value for later use in reverse mapping (MIDI->OSC) -ag
+        vals[k] = val;
+    }
     if (strict_match)
     {
         // Check for consistency of variable bindings.
@@ -1578,31 +2041,44 @@ int try_match_osc(PAIRHANDLE ph, char* path, char* types, lo_arg** argv, int arg
             {
                 // two different occurrences of the same variable on the lhs - check
                 // that their values are the same
-                float y1 = p->regs[i], y2 = p->regs[j];
+                float y1 = vals[i], y2 = vals[j];
                 float a1 = p->osc_scale[i], a2 = p->osc_scale[j];
                 float b1 = p->osc_offset[i], b2 = p->osc_offset[j];
                 if ((y1-b1)*a2 != (y2-b2)*a1) return 0;
             }
         }
     }
+    //it's a match, now the registers can be updated
+    for(i=0; i<p->argc+p->argc_in_path; i++)
+        set_reg(&p->regs[i], vals[i]);
     // Handle setchannel et al. Note that the return value -1 doesn't indicate
     // an error, but that we don't need to send a midi message (ret 0 denotes
     // error).
     if(p->set_channel)
     {
-        *glob_chan = msg[1];
+        __atomic_store_n(glob_chan, msg[1], __ATOMIC_RELAXED);
         return -1;
     }
     else if(p->set_velocity)
     {
-        *glob_vel = msg[1];
+        __atomic_store_n(glob_vel, msg[1], __ATOMIC_RELAXED);
         return -1;
     }
     else if(p->set_shift)
     {
-        *filter = msg[1];
+        __atomic_store_n(filter, (int8_t)msg[1], __ATOMIC_RELAXED);
         return -1;
     }
+    if(p->min_interval || p->deadband)
+    {
+        switch(throttle_osc(p, msg))
+        {
+        case 0:
+            return -2;
+        case -1:
+            return -3;
+        }
+    }
     return 1;
 }
 
@@ -1648,14 +2124,21 @@ int load_osc_value(lo_message oscm, char type, float val)
         lo_message_add_string(oscm,"");//at some point may want to be able to interpret/send numbers as strings?
         break;
     case 'b'://blob
-        lo_message_add_blob(oscm,0);
+    {
+        lo_blob b = lo_blob_new(0,NULL);
+        lo_message_add_blob(oscm,b);
+        lo_blob_free(b);
+        break;
+    }
     case 'S'://symbol
         lo_message_add_symbol(oscm,"");
+        break;
     case 't'://timetag
     {
         lo_timetag t;
         lo_timetag_now(&t);
         lo_message_add_timetag(oscm,t);
+        break;
     }
     default:
         //this isn't supported, they shouldn't use it as an arg, return error
@@ -1665,11 +2148,43 @@ int load_osc_value(lo_message oscm, char type, float val)
     return 1;
 }
 
+//same as above but for an arg already in the message
+static void store_osc_value(lo_arg* arg, char type, float val)
+{
+    switch(type)
+    {
+    case 'i':
+        arg->i = (int)val;
+        break;
+    case 'h'://long
+        arg->h = (long)val;
+        break;
+    case 'f':
+        arg->f = val;
+        break;
+    case 'd':
+        arg->d = (double)val;
+        break;
+    case 'c'://char (stored in 32 bits)
+        arg->i = 0;
+        arg->c = (char)val;
+        break;
+    case 't'://timetag
+        lo_timetag_now(&arg->t);
+        break;
+    default:
+        //no value or just left at the null value
+        break;
+    }
+}
+
 //see if incoming midi message matches this pair and create the associated OSC message
-int try_match_midi(PAIRHANDLE ph, uint8_t msg[], uint8_t strict_match, uint8_t* glob_chan, char* path, lo_message oscm)
+//the message is returned in oscm, it belongs to the pair and is only valid
+//until the next call for the same pair
+int try_match_midi(PAIRHANDLE ph, uint8_t msg[], uint8_t strict_match, uint8_t* glob_chan, char* path, lo_message* oscm)
 {
     PAIR* p = (PAIR*)ph;
-    uint8_t i,m[4] = {0,0,0,0}, noteon = 0;
+    uint8_t i, noteon = 0;
     int8_t place;
     char chunk[100];
 
@@ -1693,7 +2208,7 @@ int try_match_midi(PAIRHANDLE ph, uint8_t msg[], uint8_t strict_match, uint8_t*
         }
 
         //check the channel
-        if(p->use_glob_chan && (msg[0]&0x0F) != *glob_chan)
+        if(p->use_glob_chan && (msg[0]&0x0F) != __atomic_load_n(glob_chan, __ATOMIC_RELAXED))
         {
             return 0;
         }
@@ -1733,7 +2248,7 @@ int try_match_midi(PAIRHANDLE ph, uint8_t msg[], uint8_t strict_match, uint8_t*
             place = p->osc_map[i+p->argc_in_path];
             if(place == 3)
             {
-                load_osc_value( oscm,p->types[i],p->osc_scale[i+p->argc_in_path]*(noteon - p->midi_offset[place]) / p->midi_scale[place] + p->osc_offset[i+p->argc_in_path] );
+                store_osc_value( p->oscv[i], p->types[i], p->osc_a[i+p->argc_in_path]*noteon + p->osc_b[i+p->argc_in_path] );
             }
             else if(place != -1)
             {
@@ -1750,16 +2265,16 @@ int try_match_midi(PAIRHANDLE ph, uint8_t msg[], uint8_t strict_match, uint8_t*
                     //pitchbend is special case (14 bit number)
                     midival += msg[place+1]*128;
                 }
-                val = p->osc_scale[i+p->argc_in_path]*((float)midival - p->midi_offset[place]) / p->midi_scale[place] + p->osc_offset[i+p->argc_in_path];
+                val = p->osc_a[i+p->argc_in_path]*midival + p->osc_b[i+p->argc_in_path];
                 //record the value for later use in reverse mapping -ag
-                p->regs[i+p->argc_in_path] = val;
-                load_osc_value( oscm,p->types[i],val );
+                set_reg(&p->regs[i+p->argc_in_path], val);
+                store_osc_value( p->oscv[i], p->types[i], val );
             }
             else
             {
                 // value not in message, grab default or previously recorded value -ag
-                float val = p->osc_const[i+p->argc_in_path]?p->osc_val[i+p->argc_in_path]:p->regs[i+p->argc_in_path];
-                load_osc_value( oscm, p->types[i], val );
+                float val = p->osc_const[i+p->argc_in_path]?p->osc_val[i+p->argc_in_path]:get_reg(&p->regs[i+p->argc_in_path]);
+                store_osc_value( p->oscv[i], p->types[i], val );
             }
         }
     }
@@ -1780,25 +2295,24 @@ int try_match_midi(PAIRHANDLE ph, uint8_t msg[], uint8_t strict_match, uint8_t*
             {
                 if (p->n!=1)
                     return 0; // this is only supported for midimessage()
-                m[1] = msg[0];
-                m[2] = msg[1];
-                m[3] = msg[2];
-                m[0] = 0;//port ID
-                lo_message_add_midi(oscm,m);
+                p->oscv[i]->m[0] = 0;//port ID
+                p->oscv[i]->m[1] = msg[0];
+                p->oscv[i]->m[2] = msg[1];
+                p->oscv[i]->m[3] = msg[2];
             }
             else if(place != -1)
             {
                 int midival = msg[place];
-                float val = p->osc_scale[i+p->argc_in_path]*((float)midival - p->midi_offset[place]) / p->midi_scale[place] + p->osc_offset[i+p->argc_in_path];
+                float val = p->osc_a[i+p->argc_in_path]*midival + p->osc_b[i+p->argc_in_path];
                 //record the value for later use in reverse mapping -ag
-                p->regs[i+p->argc_in_path] = val;
-                load_osc_value( oscm,p->types[i],val );
+                set_reg(&p->regs[i+p->argc_in_path], val);
+                store_osc_value( p->oscv[i], p->types[i], val );
             }
             else
             {
                 //we have no idea what should be in these, so just load a previously recorded value or the defaults
-                float val = p->osc_const[i+p->argc_in_path]?p->osc_val[i+p->argc_in_path]:p->regs[i+p->argc_in_path];
-                load_osc_value( oscm, p->types[i], val );
+                float val = p->osc_const[i+p->argc_in_path]?p->osc_val[i+p->argc_in_path]:get_reg(&p->regs[i+p->argc_in_path]);
+                store_osc_value( p->oscv[i], p->types[i], val );
             }
         }
     }
@@ -1810,7 +2324,7 @@ int try_match_midi(PAIRHANDLE ph, uint8_t msg[], uint8_t strict_match, uint8_t*
         place = p->osc_map[i];
         if(place == 3)
         {
-            sprintf(chunk,p->path[i], (int)(p->osc_scale[i]*(noteon - p->midi_offset[place]) / p->midi_scale[place] + p->osc_offset[i]));
+            sprintf(chunk,p->path[i], (int)(p->osc_a[i]*noteon + p->osc_b[i]));
         }
         else if(place != -1)
         {
@@ -1827,15 +2341,15 @@ int try_match_midi(PAIRHANDLE ph, uint8_t msg[], uint8_t strict_match, uint8_t*
                 //pitchbend is special case (14 bit number)
                 midival += msg[place+1]*128;
             }
-            val = p->osc_scale[i]*(midival - p->midi_offset[place]) / p->midi_scale[place] + p->osc_offset[i];
+            val = p->osc_a[i]*midival + p->osc_b[i];
             //record the value for later use in reverse mapping -ag
-            p->regs[i] = val;
+            set_reg(&p->regs[i], val);
             sprintf(chunk, p->path[i], (int)val);
         }
         else
         {
             // value not in message, grab default or previously recorded value -ag
-            float val = p->osc_const[i]?p->osc_val[i]:p->regs[i];
+            float val = p->osc_const[i]?p->osc_val[i]:get_reg(&p->regs[i]);
             sprintf(chunk, p->path[i], (int)val);
         }
         strcat(path, chunk);
@@ -1866,6 +2380,7 @@ int try_match_midi(PAIRHANDLE ph, uint8_t msg[], uint8_t strict_match, uint8_t*
         }
     }
 
+    *oscm = p->oscm;
     return 1;
 }
 
@@ -2008,12 +2523,24 @@ char * opcode2cmd(uint8_t opcode, uint8_t noteoff)
     }
 }
 
-void print_midi(PAIRHANDLE ph, uint8_t msg[])
+//the opcode of a rawmidi or midimessage pair, -1 for any other
+int get_pair_raw_opcode(PAIRHANDLE ph)
 {
     PAIR* p = (PAIR*)ph;
+    return p->raw_midi ? p->opcode : -1;
+}
+
+void print_midi(PAIRHANDLE ph, uint8_t msg[])
+{
+    print_midi_msg(msg, get_pair_raw_opcode(ph));
+}
+
+//same without the pair, raw is what get_pair_raw_opcode() returned for it
+void print_midi_msg(uint8_t msg[], int raw)
+{
     int status = msg[0]&0xf0;
-    if(p->raw_midi) // this needs special treatment
-        printf("%s ( %i, %i, %i )", opcode2cmd(p->opcode,1), msg[0], msg[1], msg[2]);
+    if(raw >= 0) // this needs special treatment
+        printf("%s ( %i, %i, %i )", opcode2cmd(raw,1), msg[0], msg[1], msg[2]);
     else if (status == 0xc0 || status == 0xd0)
     {
         // single data byte
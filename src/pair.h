@@ -14,10 +14,19 @@ PAIRHANDLE alloc_pair(char* config, table tab, float** regs, int* nkeys);
 void free_pair(PAIRHANDLE ph);
 int try_match_osc(PAIRHANDLE ph, char* path, char* types, lo_arg** argv, int argc,
                   uint8_t strict_match, uint8_t* glob_chan, uint8_t* glob_vel, int8_t* filter, uint8_t msg[]);
-int try_match_midi(PAIRHANDLE ph, uint8_t msg[], uint8_t strict_match, uint8_t* glob_chan, char* path, lo_message oscm);
+int take_pair_held(PAIRHANDLE ph, uint8_t msg[], uint32_t* wait);
+int try_match_midi(PAIRHANDLE ph, uint8_t msg[], uint8_t strict_match, uint8_t* glob_chan, char* path, lo_message* oscm);
+void detach_pair_message(PAIRHANDLE ph);
+int load_osc_value(lo_message oscm, char type, float val);
 void print_pair(PAIRHANDLE ph);
+int get_pair_osc_prefix(PAIRHANDLE ph, char* prefix);
+char* get_pair_types(PAIRHANDLE ph);
+int get_pair_osc_path(PAIRHANDLE ph, const int v[], char* path);
+int get_pair_midi_keys(PAIRHANDLE ph, uint8_t smin[], uint8_t smax[], uint8_t* dmin, uint8_t* dmax);
 int check_pair_set_for_filter(PAIRHANDLE* pa, int npair);
 char * opcode2cmd(uint8_t opcode, uint8_t noteoff);
 void print_midi(PAIRHANDLE ph, uint8_t msg[]);
+int get_pair_raw_opcode(PAIRHANDLE ph);
+void print_midi_msg(uint8_t msg[], int raw);
 
 #endif
@@ -0,0 +1,92 @@
+//rtlog.c
+
+//printf() can block (stdout is locked, the terminal can be slow) and the
+//realtime thread must never block, so it logs here and the main loop prints
+
+/* A bounded queue of fixed size records, the one by Dmitry Vyukov: each
+   record has a sequence number that tells whose turn it is, so any thread
+   can log (claiming a record with a CAS on head) and one thread drains,
+   without locks and without ever waiting on each other. The format string
+   isn't copied, which is why it has to be a literal.
+
+   The sequence of record i starts out as i, which would need an init
+   function, so what's stored is the sequence minus i instead. That way a
+   zeroed array is a valid empty log and it can be used from the start. */
+
+#include<stdio.h>
+#include<stdint.h>
+#include"rtlog.h"
+
+//number of records (power of 2)
+#define RTLOG_SIZE 256
+
+typedef struct _RTLOG_REC
+{
+    uint32_t seq;       //minus the index, see above
+    const char* fmt;
+    long a;
+    long b;
+} RTLOG_REC;
+
+static RTLOG_REC recs[RTLOG_SIZE];
+static uint32_t head = 0;   //next record to claim
+static uint32_t tail = 0;   //next record to print, only the drainer has it
+static unsigned long lost = 0;
+
+void rtlog(const char* fmt, long a, long b)
+{
+    uint32_t pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    uint32_t i;
+    int32_t d;
+
+    for(;;)
+    {
+        i = pos & (RTLOG_SIZE-1);
+        d = (int32_t)(__atomic_load_n(&recs[i].seq, __ATOMIC_ACQUIRE) + i - pos);
+        if(!d)
+        {
+            //it's free, try to take it (pos gets the current head if not)
+            if(__atomic_compare_exchange_n(&head, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if(d < 0)
+        {
+            //not printed yet, full
+            __atomic_fetch_add(&lost, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        else
+            pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    }
+    recs[i].fmt = fmt;
+    recs[i].a = a;
+    recs[i].b = b;
+    __atomic_store_n(&recs[i].seq, pos+1 - i, __ATOMIC_RELEASE);
+}
+
+int rtlog_drain(void)
+{
+    int n = 0;
+    uint32_t i;
+    unsigned long l;
+
+    for(;;)
+    {
+        i = tail & (RTLOG_SIZE-1);
+        if(__atomic_load_n(&recs[i].seq, __ATOMIC_ACQUIRE) + i != tail+1)
+            break;
+        printf(recs[i].fmt, recs[i].a, recs[i].b);
+        printf("\n");
+        __atomic_store_n(&recs[i].seq, tail+RTLOG_SIZE - i, __ATOMIC_RELEASE);
+        tail++;
+        n++;
+    }
+    if((l = __atomic_exchange_n(&lost, 0, __ATOMIC_RELAXED)))
+    {
+        printf("(%lu more messages from the realtime thread were lost)\n", l);
+        n++;
+    }
+    if(n)
+        fflush(stdout);
+    return n;
+}
@@ -0,0 +1,15 @@
+//rtlog.h
+
+//logging from the realtime thread(s), see rtlog.c
+
+#ifndef RTLOG_H
+#define RTLOG_H
+
+//queue a message, fmt must be a string literal with at most two %ld in it
+//never blocks, if the log is full the message is only counted
+void rtlog(const char* fmt, long a, long b);
+
+//print what was logged, from a thread that can block, returns how many
+int rtlog_drain(void);
+
+#endif
@@ -0,0 +1,69 @@
+//stats.c
+
+//counters and timing histograms for running osc2midi headless
+
+/* Everything here is written from the threads doing the actual work (the osc
+   server or workers, the main loop and the midi driver's realtime thread)
+   and read from whichever thread answers /osc2midi/stats, so there are no
+   locks, just relaxed atomic adds. The numbers read can be a message apart
+   from each other, which doesn't matter for stats.
+
+   Times are kept in log2 histograms, one bucket per power of 2 ns, which is
+   cheap to update and precise enough to tell a 10us match from a 1ms one.
+   Percentiles are the upper bound of the bucket they fall in. */
+
+#include<string.h>
+#include<time.h>
+#include"stats.h"
+
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+void stats_add(STATS_HIST* h, uint64_t ns)
+{
+    int i = ns < 2 ? 0 : 63 - __builtin_clzll(ns);
+    unsigned long max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+    if(i >= STATS_BUCKETS)
+        i = STATS_BUCKETS-1;
+    __atomic_fetch_add(&h->bucket[i], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, ns, __ATOMIC_RELAXED);
+    while(ns > max && !__atomic_compare_exchange_n(&h->max, &max, ns, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+//a copy that doesn't change while it's looked at
+void stats_read(const STATS_HIST* h, STATS_HIST* copy)
+{
+    int i;
+    copy->n = 0;
+    for(i=0; i<STATS_BUCKETS; i++)
+    {
+        copy->bucket[i] = __atomic_load_n(&h->bucket[i], __ATOMIC_RELAXED);
+        copy->n += copy->bucket[i];
+    }
+    copy->sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+    copy->max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+}
+
+//in ns, p from 0 to 1
+double stats_percentile(const STATS_HIST* h, double p)
+{
+    int i;
+    unsigned long n = 0;
+
+    if(!h->n)
+        return 0;
+    for(i=0; i<STATS_BUCKETS-1; i++)
+    {
+        n += h->bucket[i];
+        if(n >= p*h->n)
+            break;
+    }
+    if(i == STATS_BUCKETS-1 || (2ULL<<i) > h->max)
+        return h->max;
+    return 2ULL<<i;
+}
@@ -0,0 +1,37 @@
+//stats.h
+
+//counters and timing histograms that can be read while osc2midi runs
+//see stats.c for more info
+
+#ifndef STATS_H
+#define STATS_H
+
+#include<stdint.h>
+
+//bucket i counts the times from 2^i up to 2^(i+1) ns, the last one also
+//everything longer
+#define STATS_BUCKETS 32
+
+typedef struct _STATS_HIST
+{
+    unsigned long n;    //only filled in by stats_read(), it's the sum of the buckets
+    unsigned long sum;  //ns
+    unsigned long max;
+    unsigned long bucket[STATS_BUCKETS];
+} STATS_HIST;
+
+//what the converters count
+typedef struct _STATS
+{
+    unsigned long osc_tries;  //try_match_osc calls
+    unsigned long midi_tries; //try_match_midi calls
+    STATS_HIST osc_time;      //msg_handler, per osc message (so also how many)
+    STATS_HIST midi_time;     //convert_midi_in, per midi message
+} STATS;
+
+uint64_t stats_now(void);
+void stats_add(STATS_HIST* h, uint64_t ns);
+void stats_read(const STATS_HIST* h, STATS_HIST* copy);
+double stats_percentile(const STATS_HIST* h, double p);
+
+#endif
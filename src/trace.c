@@ -0,0 +1,302 @@
+//trace.c
+
+//verbose (-v) and monitor (-mon) output without printf on the conversion path
+
+/* Printing every match right where it happens means a slow terminal (or a
+   pipe into a logger that can't keep up) slows down the conversions, and
+   the osc threads all wait on the lock of stdout. So the converters only
+   copy what is to be printed into a fixed size record here, and a thread of
+   our own formats and prints them. If it falls behind and the records run
+   out, new ones are dropped and counted instead of waiting for it.
+
+   The records go through the same kind of queue as in rtlog.c (several
+   threads write, one reads, no locks), except that a record is filled in
+   place between claiming and publishing it since it is fairly big. The
+   path and the arguments are cut short if they don't fit, which is marked
+   with "..." in the output. */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<pthread.h>
+#include"trace.h"
+#include"pair.h"
+
+//number of records (power of 2)
+#define TRACE_SIZE 1024
+#define TRACE_PATH 64
+#define TRACE_ARGS 8
+
+typedef struct _TRACE_REC
+{
+    uint32_t seq;       //minus the index, see rtlog.c
+    uint8_t kind;
+    uint8_t first;      //first match of the message
+    int8_t n;           //what try_match_osc returned
+    int16_t raw;        //get_pair_raw_opcode() of the rule
+    uint8_t midi[3];
+    uint8_t argc;       //args of the message, only TRACE_ARGS are kept
+    char path[TRACE_PATH];
+    char types[TRACE_ARGS+1];
+    lo_arg arg[TRACE_ARGS];
+} TRACE_REC;
+
+static TRACE_REC recs[TRACE_SIZE];
+static uint32_t head = 0;
+static uint32_t tail = 0;
+static unsigned long dropped = 0;
+static pthread_t thread;
+static int running = 0;
+
+//a record to fill in or NULL if they are all taken
+static TRACE_REC* trace_claim(void)
+{
+    uint32_t pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    uint32_t i;
+    int32_t d;
+
+    for(;;)
+    {
+        i = pos & (TRACE_SIZE-1);
+        d = (int32_t)(__atomic_load_n(&recs[i].seq, __ATOMIC_ACQUIRE) + i - pos);
+        if(!d)
+        {
+            if(__atomic_compare_exchange_n(&head, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                return &recs[i];
+        }
+        else if(d < 0)
+        {
+            __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        else
+            pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    }
+}
+
+//hand a filled in record to the printing thread
+static void trace_publish(TRACE_REC* r)
+{
+    uint32_t i = r - recs;
+    //the seq it had when claimed tells which round of the ring this is
+    uint32_t pos = r->seq + i;
+    __atomic_store_n(&r->seq, pos+1 - i, __ATOMIC_RELEASE);
+}
+
+static void copy_path(TRACE_REC* r, const char* path)
+{
+    size_t n = strlen(path);
+    if(n < TRACE_PATH)
+        memcpy(r->path, path, n+1);
+    else
+    {
+        memcpy(r->path, path, TRACE_PATH-4);
+        strcpy(r->path+TRACE_PATH-4, "...");
+    }
+}
+
+static void copy_args(TRACE_REC* r, const char* types, lo_arg** argv, int argc)
+{
+    int i;
+
+    r->argc = argc > 255 ? 255 : argc;
+    for(i=0; i<argc && i<TRACE_ARGS; i++)
+    {
+        r->types[i] = types[i];
+        switch(types[i])
+        {
+        case 'h':
+        case 'd':
+        case 't':
+            memcpy(&r->arg[i], argv[i], 8);
+            break;
+        case 'i':
+        case 'f':
+        case 'c':
+        case 'm':
+            memcpy(&r->arg[i], argv[i], 4);
+            break;
+        case 's':
+        case 'S':
+            //as much of the string as fits
+            strncpy((char*)&r->arg[i], (char*)argv[i], sizeof(lo_arg)-1);
+            ((char*)&r->arg[i])[sizeof(lo_arg)-1] = 0;
+            break;
+        default:
+            //no value (T, F, N, I) or nothing that can be printed (blobs)
+            break;
+        }
+    }
+    r->types[i] = 0;
+}
+
+void trace_osc(int kind, int first, const char* path, const char* types, lo_arg** argv, int argc,
+               const uint8_t midi[], int n, int raw)
+{
+    TRACE_REC* r = trace_claim();
+    if(!r)
+        return;
+    r->kind = kind;
+    r->first = first;
+    r->n = n;
+    r->raw = raw;
+    if(midi)
+        memcpy(r->midi, midi, 3);
+    copy_path(r, path);
+    copy_args(r, types, argv, argc);
+    trace_publish(r);
+}
+
+void trace_midi(int first, const uint8_t midi[], int raw, const char* path, lo_message oscm)
+{
+    TRACE_REC* r = trace_claim();
+    if(!r)
+        return;
+    r->kind = TRACE_M2O;
+    r->first = first;
+    r->n = 1;
+    r->raw = raw;
+    memcpy(r->midi, midi, 3);
+    copy_path(r, path);
+    copy_args(r, lo_message_get_types(oscm), lo_message_get_argv(oscm), lo_message_get_argc(oscm));
+    trace_publish(r);
+}
+
+void trace_end(void)
+{
+    TRACE_REC* r = trace_claim();
+    if(!r)
+        return;
+    r->kind = TRACE_END;
+    trace_publish(r);
+}
+
+///////////////////////////////////////
+//everything below runs in trace_thread
+///////////////////////////////////////
+
+static void print_args(TRACE_REC* r)
+{
+    int i;
+
+    for(i=0; r->types[i]; i++)
+    {
+        printf(", ");
+        switch(r->types[i])
+        {
+        case 's':
+        case 'S':
+            printf("\"%s%s\"", (char*)&r->arg[i],
+                   strlen((char*)&r->arg[i]) == sizeof(lo_arg)-1 ? "..." : "");
+            break;
+        case 'b':
+            printf("[blob]");
+            break;
+        default:
+            lo_arg_pp((lo_type)r->types[i], &r->arg[i]);
+            break;
+        }
+    }
+    if(r->argc > TRACE_ARGS)
+        printf(", ...");
+}
+
+static void print_rec(TRACE_REC* r)
+{
+    switch(r->kind)
+    {
+    case TRACE_MON:
+        printf("%s %s", r->path, r->types);
+        print_args(r);
+        printf("\n\n");
+        break;
+    case TRACE_O2M:
+        if(r->first)
+            printf("matches found:\n");
+        printf("  %s %s", r->path, r->types);
+        print_args(r);
+        printf(" -> ");
+        if(r->n > 0)
+            print_midi_msg(r->midi, r->raw);
+        else if(r->n == -2)
+            printf("(throttled)");
+        else if(r->n == -3)
+            printf("(held back)");
+        else
+            printf("%s ( %i )", opcode2cmd(r->midi[0],1), (int8_t) r->midi[1]);
+        printf("\n");
+        break;
+    case TRACE_M2O:
+        if(r->first)
+            printf("matches found:\n");
+        printf("  ");
+        print_midi_msg(r->midi, r->raw);
+        printf(" -> %s %s", r->path, r->types);
+        print_args(r);
+        printf("\n");
+        break;
+    case TRACE_END:
+        printf("\n");
+        break;
+    }
+}
+
+//print what's there, returns how many
+static int trace_drain(void)
+{
+    int n = 0;
+    uint32_t i;
+    unsigned long d;
+
+    for(;;)
+    {
+        i = tail & (TRACE_SIZE-1);
+        if(__atomic_load_n(&recs[i].seq, __ATOMIC_ACQUIRE) + i != tail+1)
+            break;
+        print_rec(&recs[i]);
+        __atomic_store_n(&recs[i].seq, tail+TRACE_SIZE - i, __ATOMIC_RELEASE);
+        tail++;
+        n++;
+    }
+    if((d = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED)))
+    {
+        printf("(%lu messages not printed, output too slow)\n\n", d);
+        n++;
+    }
+    if(n)
+        fflush(stdout);
+    return n;
+}
+
+static void* trace_thread(void* arg)
+{
+    while(__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+    {
+        if(!trace_drain())
+            usleep(10000);
+    }
+    trace_drain();
+    return NULL;
+}
+
+int start_trace(void)
+{
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+    if(pthread_create(&thread, NULL, trace_thread, NULL))
+    {
+        printf("Could not start the thread for the verbose output.\n");
+        running = 0;
+        return 0;
+    }
+    return 1;
+}
+
+//prints what is left before it returns
+void stop_trace(void)
+{
+    if(!running)
+        return;
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+}
@@ -0,0 +1,27 @@
+//trace.h
+
+//verbose and monitor output, formatted and printed on a thread of its own
+//see trace.c for more info
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include<stdint.h>
+#include"lo/lo.h"
+
+//kinds of records
+#define TRACE_MON 0 //an osc message in monitor mode
+#define TRACE_O2M 1 //a rule that matched an osc message
+#define TRACE_M2O 2 //a rule that matched a midi message
+#define TRACE_END 3 //the end of the matches for one message
+
+int start_trace(void);
+void stop_trace(void);
+
+//these only copy what is printed later, they never block
+void trace_osc(int kind, int first, const char* path, const char* types, lo_arg** argv, int argc,
+               const uint8_t midi[], int n, int raw);
+void trace_midi(int first, const uint8_t midi[], int raw, const char* path, lo_message oscm);
+void trace_end(void);
+
+#endif